@@ -0,0 +1,191 @@
+//
+// d88 Catalog Library
+//
+#ifndef __MCAT_H_
+#define __MCAT_H_
+
+#include "MD88.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ======================================================================
+// Catalog file format
+// ======================================================================
+// A catalog indexes a library of disk images, so that an image can be found
+// by its disk name or content hash without opening any image file, and
+// mounted without reading its header (see mcat_header()).
+// It is built by mkcatalog, and mapped into memory as it is.
+//
+//   mcat_hdr_t
+//   mcat_entry_t[num]   sorted by hash
+//   uint32_t[num]       entry numbers sorted by disk name
+//   char[]              NUL-terminated paths
+#define MCAT_MAGIC "MCAT"
+#define MCAT_VERSION 2
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t num;
+    uint32_t name_index; // File offset of the name index
+    uint32_t strings;    // File offset of the paths
+    uint32_t strings_size;
+} mcat_hdr_t;
+
+typedef struct {
+    uint64_t hash;  // FNV-1a of the whole (uncompressed) image
+    int64_t mtime;  // Of the image file
+    int64_t size;   // Of the image file
+    uint32_t path;  // Offset in the paths
+    char disk[17];  // Disk name (NUL-terminated)
+    uint8_t reserve[3];
+    disk_hdr_t hdr; // Header of the image as it is
+} mcat_entry_t;
+
+typedef struct {
+    void *map;
+    size_t map_size;
+    const mcat_hdr_t *hdr;
+    const mcat_entry_t *entry;
+    const uint32_t *name_index;
+    const char *strings;
+} mcat_t;
+
+// ======================================================================
+// Open and look up
+// ======================================================================
+int mcat_open(mcat_t *cat, const char *fname) {
+    memset(cat, 0, sizeof(*cat));
+
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(mcat_hdr_t)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    const mcat_hdr_t *hdr = (const mcat_hdr_t *)map;
+    if (!memcmp(hdr->magic, MCAT_MAGIC, sizeof(hdr->magic)) && hdr->version != MCAT_VERSION) {
+        fprintf(stderr, "MCAT: Catalog of version %u, rebuild it [%s]\n", hdr->version, fname);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    uint64_t entries_end = sizeof(mcat_hdr_t) + (uint64_t)hdr->num * sizeof(mcat_entry_t);
+    if (memcmp(hdr->magic, MCAT_MAGIC, sizeof(hdr->magic)) || hdr->version != MCAT_VERSION ||
+        hdr->name_index < entries_end || hdr->name_index + (uint64_t)hdr->num * sizeof(uint32_t) > hdr->strings ||
+        hdr->strings + (uint64_t)hdr->strings_size > (uint64_t)st.st_size ||
+        (hdr->strings_size && ((const char *)map)[hdr->strings + hdr->strings_size - 1] != '\0')) {
+        fprintf(stderr, "MCAT: Broken catalog [%s]\n", fname);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    // Every index and string must stay inside the map.
+    const mcat_entry_t *entry = (const mcat_entry_t *)(hdr + 1);
+    const uint32_t *name_index = (const uint32_t *)((const uint8_t *)map + hdr->name_index);
+    for (uint32_t i = 0; i < hdr->num; i++) {
+        if (name_index[i] >= hdr->num || entry[i].path >= hdr->strings_size || entry[i].disk[sizeof(entry[i].disk) - 1]) {
+            fprintf(stderr, "MCAT: Broken catalog [%s]\n", fname);
+            munmap(map, st.st_size);
+            return -1;
+        }
+    }
+
+    cat->map = map;
+    cat->map_size = st.st_size;
+    cat->hdr = hdr;
+    cat->entry = (const mcat_entry_t *)(hdr + 1);
+    cat->name_index = (const uint32_t *)((const uint8_t *)map + hdr->name_index);
+    cat->strings = (const char *)map + hdr->strings;
+    return 0;
+}
+
+void mcat_close(mcat_t *cat) {
+    if (cat->map != NULL) {
+        munmap(cat->map, cat->map_size);
+    }
+    memset(cat, 0, sizeof(*cat));
+}
+
+const char *mcat_path(const mcat_t *cat, const mcat_entry_t *e) {
+    return e->path < cat->hdr->strings_size ? cat->strings + e->path : "";
+}
+
+const mcat_entry_t *mcat_find_hash(const mcat_t *cat, uint64_t hash) {
+    int lo = 0, hi = (int)cat->hdr->num - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cat->entry[mid].hash == hash) {
+            return &cat->entry[mid];
+        }
+        if (cat->entry[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+// Returns the first entry with the name
+const mcat_entry_t *mcat_find_name(const mcat_t *cat, const char *name) {
+    int lo = 0, hi = (int)cat->hdr->num;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strncmp(cat->entry[cat->name_index[mid]].disk, name, sizeof(cat->entry->disk)) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < (int)cat->hdr->num) {
+        const mcat_entry_t *e = &cat->entry[cat->name_index[lo]];
+        if (strncmp(e->disk, name, sizeof(e->disk)) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Get the header of an image from its entry. Fails if the image has been
+// modified since it was cataloged.
+int mcat_header(const mcat_t *cat, const mcat_entry_t *e, disk_hdr_t *hdr) {
+    struct stat st;
+    if (stat(mcat_path(cat, e), &st) || st.st_size != e->size || st.st_mtime != e->mtime) {
+        return -1;
+    }
+    *hdr = e->hdr;
+    return 0;
+}
+
+// Find an image by its disk name, or by its hash in 16 hex digits
+const mcat_entry_t *mcat_find(const mcat_t *cat, const char *key) {
+    if (cat->map == NULL) {
+        return NULL;
+    }
+    const mcat_entry_t *e = mcat_find_name(cat, key);
+    if (e == NULL && strlen(key) == 16 && strspn(key, "0123456789abcdefABCDEF") == 16) {
+        e = mcat_find_hash(cat, strtoull(key, NULL, 16));
+    }
+    return e;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __MCAT_H_
@@ -9,6 +9,19 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#elif defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -31,6 +44,15 @@ extern "C" {
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+// FNV-1a hash
+#define MD_HASH_INIT 0xcbf29ce484222325ULL
+static inline uint64_t md_hash(const void *p, size_t len, uint64_t h) {
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ ((const uint8_t *)p)[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
 // ======================================================================
 // d88 2D disk image format
 // ======================================================================
@@ -76,8 +98,263 @@ typedef struct {
 
 static FILE *md_fp[MAX_DRIVE];
 static disk_hdr_t md_hdr[MAX_DRIVE];
+static char *md_fname[MAX_DRIVE];
 sector_t md_buf[MAX_DRIVE][NUM_SECTOR];
 
+// ======================================================================
+// Compressed (gzip) disk images
+// ======================================================================
+// A compressed image is inflated into memory by a background thread, one
+// track at a time, so that tracks already inflated can be served while the
+// rest is still being read. A modified image is deflated and written back by
+// another thread MD_WRITEBACK_DELAY seconds after it is modified.
+#define MD_IMAGE_SIZE (sizeof(disk_hdr_t) + sizeof(sector_t) * NUM_SECTOR * NUM_TRACK)
+#define MD_WRITEBACK_DELAY 1
+
+typedef struct {
+    char *fname;
+    gzFile gz;
+    uint8_t *dat; // Inflated image
+    long size;    // Size of dat
+    long avail;   // Bytes inflated so far
+    long end;     // Size of the image to be written back
+    int done;     // Inflation has finished
+    int dirty;    // Modified after the last write back
+    int quit;
+    pthread_t inflater;
+    pthread_t deflater;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} md_zimg_t;
+
+static md_zimg_t *md_zimg[MAX_DRIVE];
+static long md_pos[MAX_DRIVE];
+
+// Check gzip magic number
+int md_is_gzip(FILE *fp) {
+    uint8_t magic[2];
+    fseek(fp, 0, SEEK_SET);
+    int ret = fread(magic, sizeof(magic), 1, fp) == 1 && magic[0] == 0x1f && magic[1] == 0x8b;
+    fseek(fp, 0, SEEK_SET);
+    return ret;
+}
+
+// Wait until the image is inflated up to the end offset
+static void md_zwait(md_zimg_t *z, long end) {
+    pthread_mutex_lock(&z->lock);
+    while (!z->done && z->avail < end) {
+        pthread_cond_wait(&z->cond, &z->lock);
+    }
+    pthread_mutex_unlock(&z->lock);
+}
+
+void *md_inflater(void *arg) {
+    md_zimg_t *z = (md_zimg_t *)arg;
+    const long chunk = sizeof(sector_t) * NUM_SECTOR;
+
+    while (z->avail < z->size) {
+        // Nobody else touches the area beyond avail.
+        int n = gzread(z->gz, z->dat + z->avail, MIN(chunk, z->size - z->avail));
+        if (n <= 0) {
+            break;
+        }
+        pthread_mutex_lock(&z->lock);
+        z->avail += n;
+        z->end = MAX(z->end, z->avail);
+        pthread_cond_broadcast(&z->cond);
+        pthread_mutex_unlock(&z->lock);
+    }
+    gzclose(z->gz);
+    z->gz = NULL;
+
+    pthread_mutex_lock(&z->lock);
+    z->done = 1;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+    DP("MD88: Inflated [%s] (%ld bytes)\n", z->fname, z->avail);
+    return NULL;
+}
+
+// Deflate a snapshot of the image into a temporary file, and replace the original with it
+static int md_writeback(md_zimg_t *z, uint8_t *dat, long len) {
+    char tmp[strlen(z->fname) + 5];
+    sprintf(tmp, "%s.tmp", z->fname);
+
+    gzFile gz = gzopen(tmp, "wb");
+    if (gz == NULL) {
+        fprintf(stderr, "MD88: Cannot create [%s]\n", tmp);
+        return -1;
+    }
+    int ret = gzwrite(gz, dat, len) == len;
+    if (gzclose(gz) != Z_OK || !ret) {
+        fprintf(stderr, "MD88: Write failed [%s]\n", tmp);
+        unlink(tmp);
+        return -1;
+    }
+    if (rename(tmp, z->fname)) {
+        perror("MD88: Rename failed.");
+        unlink(tmp);
+        return -1;
+    }
+    DP("MD88: Wrote back [%s] (%ld bytes)\n", z->fname, len);
+    return 0;
+}
+
+void *md_deflater(void *arg) {
+    md_zimg_t *z = (md_zimg_t *)arg;
+    uint8_t *snap = malloc(z->size);
+    assert(snap != NULL);
+
+    pthread_mutex_lock(&z->lock);
+    while (1) {
+        while (!z->dirty && !z->quit) {
+            pthread_cond_wait(&z->cond, &z->lock);
+        }
+        if (!z->dirty) {
+            break;
+        }
+
+        // Wait until writes settle down
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += MD_WRITEBACK_DELAY;
+        while (!z->quit && pthread_cond_timedwait(&z->cond, &z->lock, &t) == 0) {
+        }
+        // Never replace the original with a partly inflated image
+        while (!z->done) {
+            pthread_cond_wait(&z->cond, &z->lock);
+        }
+
+        long len = z->end;
+        memcpy(snap, z->dat, len);
+        z->dirty = 0;
+        pthread_mutex_unlock(&z->lock);
+        md_writeback(z, snap, len);
+        pthread_mutex_lock(&z->lock);
+    }
+    pthread_mutex_unlock(&z->lock);
+
+    free(snap);
+    return NULL;
+}
+
+// Set up the in-memory image of a compressed disk
+int md_zopen(uint8_t drive, char *fname) {
+    md_zimg_t *z = calloc(1, sizeof(md_zimg_t));
+    assert(z != NULL);
+
+    z->gz = gzopen(fname, "rb");
+    if (z->gz == NULL) {
+        fprintf(stderr, "MD88: Cannot open [%s]\n", fname);
+        free(z);
+        return -1;
+    }
+    z->fname = strdup(fname);
+
+    // The header tells the size of the image.
+    disk_hdr_t hdr;
+    int n = gzread(z->gz, &hdr, sizeof(hdr));
+    z->size = MAX((long)MD_IMAGE_SIZE, n == (int)sizeof(hdr) ? (long)GET_4BYTE(hdr.disk_size) : 0);
+    z->dat = calloc(1, z->size);
+    assert(z->dat != NULL);
+    if (n > 0) {
+        memcpy(z->dat, &hdr, n);
+        z->avail = z->end = n;
+    }
+    if (n < (int)sizeof(hdr)) {
+        gzclose(z->gz);
+        z->gz = NULL;
+        z->done = 1;
+    }
+
+    pthread_mutex_init(&z->lock, NULL);
+    pthread_cond_init(&z->cond, NULL);
+    md_zimg[drive] = z;
+    if (!z->done) {
+        pthread_create(&z->inflater, NULL, md_inflater, z);
+    }
+    pthread_create(&z->deflater, NULL, md_deflater, z);
+    return 0;
+}
+
+void md_zclose(uint8_t drive) {
+    md_zimg_t *z = md_zimg[drive];
+    if (z == NULL) {
+        return;
+    }
+    md_zimg[drive] = NULL;
+
+    md_zwait(z, z->size);
+    if (z->inflater) {
+        pthread_join(z->inflater, NULL);
+    }
+    pthread_mutex_lock(&z->lock);
+    z->quit = 1;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+    pthread_join(z->deflater, NULL);
+
+    pthread_mutex_destroy(&z->lock);
+    pthread_cond_destroy(&z->cond);
+    free(z->dat);
+    free(z->fname);
+    free(z);
+}
+
+// ----------------------------------------------------------------------
+// Stream-like access to either the image file or the in-memory image
+// ----------------------------------------------------------------------
+int md_seek(uint8_t drive, long ofs) {
+    if (md_zimg[drive] == NULL) {
+        return fseek(md_fp[drive], ofs, SEEK_SET);
+    }
+    md_pos[drive] = ofs;
+    return 0;
+}
+
+int md_fread(uint8_t drive, void *p, size_t size) {
+    md_zimg_t *z = md_zimg[drive];
+    if (z == NULL) {
+        return fread(p, size, 1, md_fp[drive]);
+    }
+
+    long ofs = md_pos[drive];
+    if (ofs < 0 || ofs + (long)size > z->size) {
+        return 0;
+    }
+    md_zwait(z, ofs + size);
+    memcpy(p, z->dat + ofs, size);
+    md_pos[drive] += size;
+    return 1;
+}
+
+int md_fwrite(uint8_t drive, const void *p, size_t size) {
+    md_zimg_t *z = md_zimg[drive];
+    if (z == NULL) {
+        return fwrite(p, size, 1, md_fp[drive]);
+    }
+
+    long ofs = md_pos[drive];
+    if (ofs < 0 || ofs + (long)size > z->size) {
+        return 0;
+    }
+    md_zwait(z, ofs + size);
+    pthread_mutex_lock(&z->lock);
+    memcpy(z->dat + ofs, p, size);
+    z->end = MAX(z->end, ofs + (long)size);
+    z->dirty = 1;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+    md_pos[drive] += size;
+    return 1;
+}
+
+void md_fflush(uint8_t drive) {
+    if (md_zimg[drive] == NULL) {
+        fflush(md_fp[drive]);
+    }
+}
+
 // ======================================================================
 // Disk image I/O
 // ======================================================================
@@ -86,10 +363,525 @@ sector_t md_buf[MAX_DRIVE][NUM_SECTOR];
 #define md_write(dr, tr, sec, nsec, buf) md_access(dr, tr, sec, nsec, buf, MD_WRITE)
 #define md_read(dr, tr, sec, nsec, buf) md_access(dr, tr, sec, nsec, buf, MD_READ)
 
+// ----------------------------------------------------------------------
+// Access statistics
+// ----------------------------------------------------------------------
+// Per-sector read/write counters and a coarse sample of the access order.
+// The sample log keeps every access until it fills up; then every other
+// entry is dropped and the sampling interval doubles, so the log always
+// spans the whole session. The counters of a drive are updated under its
+// md_lock, by the pipe worker and the socket clients; the sample log is shared
+// by all drives, so it has a lock of its own. A reader of the counters may see
+// slightly stale values.
+#define MD_STAT_SAMPLES 1024
+
+typedef struct {
+    uint32_t seq; // Sequence number of the access
+    uint8_t drive;
+    uint8_t rw;
+    uint8_t tr;
+    uint8_t sec;
+    uint8_t num_sec;
+} md_sample_t;
+
+uint32_t md_stat_count[MAX_DRIVE][2][NUM_TRACK][NUM_SECTOR]; // [drive][rw - 1][tr][sec]
+md_sample_t md_stat_sample[MD_STAT_SAMPLES];
+static uint32_t md_stat_seq;
+static uint32_t md_stat_num_sample;
+static uint32_t md_stat_interval = 1;
+static pthread_mutex_t md_stat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void md_stat_access(uint8_t drive, uint8_t tr, uint8_t sec, uint8_t num_sec, uint8_t rw) {
+    pthread_mutex_lock(&md_stat_lock);
+    uint32_t seq = md_stat_seq++;
+    if (seq % md_stat_interval) {
+        pthread_mutex_unlock(&md_stat_lock);
+        return;
+    }
+    if (md_stat_num_sample == MD_STAT_SAMPLES) {
+        for (int i = 0; i < MD_STAT_SAMPLES / 2; i++) {
+            md_stat_sample[i] = md_stat_sample[i * 2];
+        }
+        md_stat_num_sample = MD_STAT_SAMPLES / 2;
+        md_stat_interval *= 2;
+        if (seq % md_stat_interval) {
+            pthread_mutex_unlock(&md_stat_lock);
+            return;
+        }
+    }
+    md_sample_t *s = &md_stat_sample[md_stat_num_sample++];
+    s->seq = seq;
+    s->drive = drive;
+    s->rw = rw;
+    s->tr = tr;
+    s->sec = sec;
+    s->num_sec = num_sec;
+    pthread_mutex_unlock(&md_stat_lock);
+}
+
+static inline void md_stat_sector(uint8_t drive, uint8_t tr, int sec, uint8_t rw) {
+    if (sec < NUM_SECTOR) {
+        md_stat_count[drive][rw - 1][tr][sec]++;
+    }
+}
+
+// Dump statistics of a drive as a JSON object
+void md_stat_json(FILE *fp, uint8_t drive) {
+    fprintf(fp, "{\"drive\":%d,\"disk\":\"", drive);
+    for (char *p = md_hdr[drive].disk; *p && p < md_hdr[drive].disk + sizeof(md_hdr[drive].disk); p++) {
+        // Bytes of Shift-JIS titles are not valid UTF-8, so they are escaped as well.
+        uint8_t c = *p;
+        fprintf(fp, (c == '"' || c == '\\' || c < 0x20 || c >= 0x7f) ? "\\u%04x" : "%c", c);
+    }
+    fprintf(fp, "\"");
+    for (int rw = MD_WRITE; rw <= MD_READ; rw++) {
+        fprintf(fp, ",\"%s\":[", rw == MD_WRITE ? "write" : "read");
+        for (int tr = 0; tr < NUM_TRACK; tr++) {
+            fprintf(fp, "%s[", tr ? "," : "");
+            for (int sec = 0; sec < NUM_SECTOR; sec++) {
+                fprintf(fp, "%s%u", sec ? "," : "", md_stat_count[drive][rw - 1][tr][sec]);
+            }
+            fprintf(fp, "]");
+        }
+        fprintf(fp, "]");
+    }
+    fprintf(fp, "}");
+}
+
+// Dump the access order sample as a JSON object
+void md_stat_json_sample(FILE *fp) {
+    pthread_mutex_lock(&md_stat_lock);
+    fprintf(fp, "{\"interval\":%u,\"accesses\":%u,\"samples\":[", md_stat_interval, md_stat_seq);
+    for (uint32_t i = 0; i < md_stat_num_sample; i++) {
+        md_sample_t *s = &md_stat_sample[i];
+        fprintf(fp, "%s[%u,%d,\"%c\",%d,%d,%d]", i ? "," : "", s->seq, s->drive, s->rw == MD_WRITE ? 'W' : 'R', s->tr, s->sec + 1, s->num_sec);
+    }
+    fprintf(fp, "]}");
+    pthread_mutex_unlock(&md_stat_lock);
+}
+
+// Print a text heatmap of a drive (a row per track, a column per sector)
+void md_stat_heatmap(FILE *fp, uint8_t drive) {
+    static const char level[] = " .:-=+*#%@";
+
+    fprintf(fp, "Drive %d [%.17s]\n", drive, md_hdr[drive].disk);
+    fprintf(fp, "      %-*s  %-*s\n", NUM_SECTOR, "Read", NUM_SECTOR, "Write");
+    for (int tr = 0; tr < NUM_TRACK; tr++) {
+        fprintf(fp, "TR%02d |", tr);
+        for (int rw = MD_READ; rw >= MD_WRITE; rw--) {
+            for (int sec = 0; sec < NUM_SECTOR; sec++) {
+                uint32_t n = md_stat_count[drive][rw - 1][tr][sec];
+                int l = 0;
+                while (n && l < (int)sizeof(level) - 2) {
+                    n >>= 1;
+                    l++;
+                }
+                fputc(level[l], fp);
+            }
+            fputc('|', fp);
+        }
+        fputc('\n', fp);
+    }
+}
+
+// ----------------------------------------------------------------------
+// Track versions
+// ----------------------------------------------------------------------
+// A sequence number per track is odd while the track is being rewritten, so
+// that md_peek() can read a consistent track without taking any lock.
+static uint32_t md_track_seq[MAX_DRIVE][NUM_TRACK];
+
+static inline void md_seq_begin(uint8_t drive, uint8_t tr) {
+    __atomic_store_n(&md_track_seq[drive][tr], md_track_seq[drive][tr] + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void md_seq_end(uint8_t drive, uint8_t tr) {
+    __atomic_store_n(&md_track_seq[drive][tr], md_track_seq[drive][tr] + 1, __ATOMIC_RELEASE);
+}
+
+// ----------------------------------------------------------------------
+// Track checksums
+// ----------------------------------------------------------------------
+// A CRC-32C of every track of an uncompressed image is kept in memory and in
+// "<image>.crc", so that a track silently corrupted on the media can be found
+// by the scrubber, or on access when md_verify is set. A track is given its
+// checksum when it is written, or when it is first read with no checksum.
+// Compressed images are not covered, as gzip has its own CRC.
+#define MD_CRC_NONE 0 // No checksum yet
+#define MD_CRC_OK 1
+#define MD_CRC_BAD 2 // Mismatch already reported
+
+int md_verify; // Verify tracks read from the image
+static int md_crc_on[MAX_DRIVE];
+static int md_crc_dirty[MAX_DRIVE];
+static uint32_t md_crc_gen[MAX_DRIVE]; // Changes on every mount
+static uint32_t md_crc[MAX_DRIVE][NUM_TRACK];
+static uint8_t md_crc_state[MAX_DRIVE][NUM_TRACK];
+static uint32_t md_crc_table[256];
+
+static struct {
+    uint64_t passes;
+    uint64_t tracks;
+    uint64_t bad;
+    uint64_t yields;
+    uint64_t cpu_ns;    // CPU time of the scrubber
+    uint64_t verified;  // Tracks verified on access
+    uint64_t verify_ns; // Time spent verifying on access
+    uint64_t verify_bad;
+} md_scrub_stat;
+
+static void md_crc_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) {
+            c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        }
+        md_crc_table[i] = c;
+    }
+}
+
+// CRC-32C, using the CRC instructions of ARMv8 or SSE4.2 when available
+static uint32_t md_crc32c(const void *p, size_t len) {
+    const uint8_t *s = (const uint8_t *)p;
+    uint32_t crc = 0xffffffff;
+#if defined(__ARM_FEATURE_CRC32) || defined(__SSE4_2__)
+    for (; len >= 4; s += 4, len -= 4) {
+        uint32_t w;
+        memcpy(&w, s, sizeof(w));
+#if defined(__ARM_FEATURE_CRC32)
+        crc = __crc32cw(crc, w);
+#else
+        crc = _mm_crc32_u32(crc, w);
+#endif
+    }
+#endif
+    for (; len; s++, len--) {
+        crc = md_crc_table[(crc ^ *s) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static inline uint64_t md_clock_ns(clockid_t clk) {
+    struct timespec t;
+    clock_gettime(clk, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// Give a track its checksum. Called with md_cache_lock held.
+static void md_crc_set(uint8_t drive, uint8_t tr, const sector_t *track) {
+    if (md_crc_on[drive]) {
+        md_crc[drive][tr] = md_crc32c(track, sizeof(sector_t) * NUM_SECTOR);
+        md_crc_state[drive][tr] = MD_CRC_OK;
+        md_crc_dirty[drive] = 1;
+    }
+}
+
+// Check a track read from the image. Called with md_cache_lock held.
+static int md_crc_check(uint8_t drive, uint8_t tr, const sector_t *track, uint64_t *stat_bad) {
+    uint32_t crc = md_crc32c(track, sizeof(sector_t) * NUM_SECTOR);
+    if (md_crc_state[drive][tr] == MD_CRC_NONE) {
+        md_crc[drive][tr] = crc;
+        md_crc_state[drive][tr] = MD_CRC_OK;
+        md_crc_dirty[drive] = 1;
+        return 0;
+    }
+    if (crc == md_crc[drive][tr]) {
+        return 0;
+    }
+    if (md_crc_state[drive][tr] != MD_CRC_BAD) {
+        fprintf(stderr, "MD88: Checksum mismatch on Drive %d Track %d [%s]\n", drive, tr, md_fname[drive]);
+        md_crc_state[drive][tr] = MD_CRC_BAD;
+    }
+    __atomic_add_fetch(stat_bad, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+// Verify a track read by the protocol side. Called with md_cache_lock held.
+static int md_crc_verify(uint8_t drive, uint8_t tr, const sector_t *track) {
+    if (!md_verify || !md_crc_on[drive]) {
+        return 0;
+    }
+    uint64_t t = md_clock_ns(CLOCK_MONOTONIC);
+    int ret = md_crc_check(drive, tr, track, &md_scrub_stat.verify_bad);
+    __atomic_add_fetch(&md_scrub_stat.verify_ns, md_clock_ns(CLOCK_MONOTONIC) - t, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&md_scrub_stat.verified, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+// ----------------------------------------------------------------------
+// Track cache
+// ----------------------------------------------------------------------
+// Tracks are kept in memory once they are loaded or prefetched. Tracks are
+// written through to the image. md_cache_lock[drive] serializes image access
+// between the protocol side and the prefetcher.
+sector_t md_cache[MAX_DRIVE][NUM_TRACK][NUM_SECTOR];
+static uint8_t md_cached[MAX_DRIVE][NUM_TRACK];
+static pthread_mutex_t md_cache_lock[MAX_DRIVE];
+
+// Load a track into the track buffer. Fails only if the track is corrupted.
+static int md_load_track(uint8_t drive, uint8_t tr) {
+    int ret = 0;
+    pthread_mutex_lock(&md_cache_lock[drive]);
+    if (md_cached[drive][tr]) {
+        memcpy(md_buf[drive], md_cache[drive][tr], sizeof(md_buf[drive]));
+    } else {
+        md_seek(drive, GET_4BYTE(md_hdr[drive].track_offset[tr]));
+        if (md_fread(drive, md_buf[drive], sizeof(md_buf[drive])) == 1) {
+            ret = md_crc_verify(drive, tr, md_buf[drive]);
+            if (ret == 0) {
+                memcpy(md_cache[drive][tr], md_buf[drive], sizeof(md_buf[drive]));
+                md_cached[drive][tr] = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&md_cache_lock[drive]);
+    return ret;
+}
+
+// Store the track buffer into a track
+static int md_store_track(uint8_t drive, uint8_t tr) {
+    int ret = -1;
+    pthread_mutex_lock(&md_cache_lock[drive]);
+    md_seq_begin(drive, tr);
+    md_cached[drive][tr] = 0;
+    if (md_seek(drive, GET_4BYTE(md_hdr[drive].track_offset[tr]))) {
+        perror("Seek failed.");
+    } else if (md_fwrite(drive, md_buf[drive], sizeof(md_buf[drive])) != 1) {
+        perror("Write failed.");
+    } else {
+        md_fflush(drive);
+        memcpy(md_cache[drive][tr], md_buf[drive], sizeof(md_buf[drive]));
+        md_cached[drive][tr] = 1;
+        md_crc_set(drive, tr, md_buf[drive]);
+        ret = 0;
+    }
+    md_seq_end(drive, tr);
+    pthread_mutex_unlock(&md_cache_lock[drive]);
+    return ret;
+}
+
+// Load a track into the cache without going through the stream, which belongs
+// to the protocol side
+static void md_prefetch_track(uint8_t drive, uint8_t tr) {
+    pthread_mutex_lock(&md_cache_lock[drive]);
+    if (md_fp[drive] != NULL && !md_cached[drive][tr] && md_zimg[drive] == NULL) {
+        ssize_t len = sizeof(md_cache[drive][tr]);
+        if (pread(fileno(md_fp[drive]), md_cache[drive][tr], len, GET_4BYTE(md_hdr[drive].track_offset[tr])) == len &&
+            md_crc_verify(drive, tr, md_cache[drive][tr]) == 0) {
+            md_cached[drive][tr] = 1;
+        }
+    }
+    pthread_mutex_unlock(&md_cache_lock[drive]);
+}
+
+// ----------------------------------------------------------------------
+// Asynchronous prefetch
+// ----------------------------------------------------------------------
+// md_prefetch() queues a track to be loaded into the cache by a background
+// thread. Requests are dropped while the queue is full.
+#define MD_PREFETCH_QUEUE 256
+
+static struct {
+    uint8_t drive;
+    uint8_t tr;
+} md_pfq[MD_PREFETCH_QUEUE];
+static uint32_t md_pfq_head, md_pfq_tail;
+static pthread_mutex_t md_pfq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t md_pfq_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t md_pfq_once = PTHREAD_ONCE_INIT;
+
+void *md_pfq_main(void *arg) {
+    pthread_mutex_lock(&md_pfq_lock);
+    while (1) {
+        while (md_pfq_head == md_pfq_tail) {
+            pthread_cond_wait(&md_pfq_cond, &md_pfq_lock);
+        }
+        uint8_t drive = md_pfq[md_pfq_tail % MD_PREFETCH_QUEUE].drive;
+        uint8_t tr = md_pfq[md_pfq_tail % MD_PREFETCH_QUEUE].tr;
+        md_pfq_tail++;
+        pthread_mutex_unlock(&md_pfq_lock);
+        md_prefetch_track(drive, tr);
+        pthread_mutex_lock(&md_pfq_lock);
+    }
+    return NULL;
+}
+
+static void md_pfq_start() {
+    pthread_t th;
+    if (pthread_create(&th, NULL, md_pfq_main, NULL) == 0) {
+        pthread_detach(th);
+    }
+}
+
+void md_prefetch(uint8_t drive, uint8_t tr) {
+    if (!(drive < MAX_DRIVE && tr < NUM_TRACK)) {
+        return;
+    }
+    pthread_once(&md_pfq_once, md_pfq_start);
+
+    pthread_mutex_lock(&md_pfq_lock);
+    if (md_pfq_head - md_pfq_tail < MD_PREFETCH_QUEUE) {
+        md_pfq[md_pfq_head % MD_PREFETCH_QUEUE].drive = drive;
+        md_pfq[md_pfq_head % MD_PREFETCH_QUEUE].tr = tr;
+        md_pfq_head++;
+        pthread_cond_signal(&md_pfq_cond);
+    }
+    pthread_mutex_unlock(&md_pfq_lock);
+}
+
+// ----------------------------------------------------------------------
+// Boot profile
+// ----------------------------------------------------------------------
+// The order of the tracks read in the first MD_BOOT_READS reads after mount
+// is saved into "<image>.boot", together with a hash of the header and the
+// IPL track. When the same image is mounted next time, the tracks are
+// prefetched in that order while the PC boots.
+#define MD_BOOT_READS 256
+#define MD_BOOT_MAGIC "MDBP"
+
+typedef struct {
+    char magic[4];
+    uint8_t num;
+    uint8_t tr[NUM_TRACK];
+    uint8_t reserve[3];
+    uint64_t hash;
+} md_boot_t;
+
+static uint64_t md_image_hash[MAX_DRIVE];
+static md_boot_t md_boot[MAX_DRIVE];     // Loaded profile
+static md_boot_t md_boot_rec[MAX_DRIVE]; // Profile being recorded
+static int md_boot_reads[MAX_DRIVE];
+static pthread_t md_prefetcher[MAX_DRIVE];
+static volatile int md_prefetch_quit[MAX_DRIVE];
+
+// Hash of the header and the IPL track
+static uint64_t md_boot_hash(uint8_t drive) {
+    uint64_t h = md_hash(&md_hdr[drive], sizeof(disk_hdr_t), MD_HASH_INIT);
+    md_seek(drive, GET_4BYTE(md_hdr[drive].track_offset[0]));
+    if (md_fread(drive, md_buf[drive], sizeof(md_buf[drive])) == 1) {
+        h = md_hash(md_buf[drive], sizeof(md_buf[drive]), h);
+    }
+    return h;
+}
+
+int md_boot_save(uint8_t drive) {
+    md_boot_t *b = &md_boot_rec[drive];
+    if (!b->num || !memcmp(b, &md_boot[drive], sizeof(md_boot_t))) {
+        return 0;
+    }
+    char path[strlen(md_fname[drive]) + 6];
+    sprintf(path, "%s.boot", md_fname[drive]);
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "MD88: Cannot create [%s]\n", path);
+        return -1;
+    }
+    int ret = fwrite(b, sizeof(md_boot_t), 1, fp);
+    fclose(fp);
+    if (ret != 1) {
+        fprintf(stderr, "MD88: Write failed [%s]\n", path);
+        return -1;
+    }
+    md_boot[drive] = *b;
+    DP("MD88: Saved boot profile [%s] (%d tracks)\n", path, b->num);
+    return 0;
+}
+
+int md_boot_load(uint8_t drive) {
+    char path[strlen(md_fname[drive]) + 6];
+    sprintf(path, "%s.boot", md_fname[drive]);
+
+    ZEROFILL(md_boot[drive]);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    md_boot_t b;
+    int ret = fread(&b, sizeof(b), 1, fp);
+    fclose(fp);
+    int ok = ret == 1 && !memcmp(b.magic, MD_BOOT_MAGIC, sizeof(b.magic)) && b.num <= NUM_TRACK && b.hash == md_image_hash[drive];
+    for (int i = 0; ok && i < b.num; i++) {
+        ok = b.tr[i] < NUM_TRACK;
+    }
+    if (!ok) {
+        DP("MD88: Ignore boot profile [%s]\n", path);
+        return -1;
+    }
+    md_boot[drive] = b;
+    return 0;
+}
+
+// Record a track read after mount
+static void md_boot_record(uint8_t drive, uint8_t tr) {
+    if (md_boot_reads[drive] >= MD_BOOT_READS) {
+        return;
+    }
+    md_boot_t *b = &md_boot_rec[drive];
+    if (!memchr(b->tr, tr, b->num)) {
+        b->tr[b->num++] = tr;
+    }
+    if (++md_boot_reads[drive] == MD_BOOT_READS) {
+        md_boot_save(drive);
+    }
+}
+
+void *md_prefetcher_main(void *arg) {
+    uint8_t drive = (uintptr_t)arg;
+    md_boot_t *b = &md_boot[drive];
+    for (int i = 0; i < b->num && !md_prefetch_quit[drive]; i++) {
+        md_prefetch_track(drive, b->tr[i]);
+    }
+    DP("MD88: Prefetched %d tracks on Drive %d\n", b->num, drive);
+    return NULL;
+}
+
+// Start recording the boot sequence, and prefetching along the last one
+void md_boot_start(uint8_t drive) {
+    md_image_hash[drive] = md_boot_hash(drive);
+    ZEROFILL(md_boot_rec[drive]);
+    memcpy(md_boot_rec[drive].magic, MD_BOOT_MAGIC, sizeof(md_boot_rec[drive].magic));
+    md_boot_rec[drive].hash = md_image_hash[drive];
+    md_boot_reads[drive] = 0;
+
+    if (md_boot_load(drive) == 0 && md_zimg[drive] == NULL) {
+        md_prefetch_quit[drive] = 0;
+        if (pthread_create(&md_prefetcher[drive], NULL, md_prefetcher_main, (void *)(uintptr_t)drive)) {
+            md_prefetcher[drive] = 0;
+        }
+    }
+}
+
+void md_boot_stop(uint8_t drive) {
+    if (md_prefetcher[drive]) {
+        md_prefetch_quit[drive] = 1;
+        pthread_join(md_prefetcher[drive], NULL);
+        md_prefetcher[drive] = 0;
+    }
+    // A short session does not replace a profile recorded in full.
+    if (!md_boot[drive].num) {
+        md_boot_save(drive);
+    }
+
+    // Nothing is recorded until md_boot_start()
+    ZEROFILL(md_boot_rec[drive]);
+    md_boot_reads[drive] = MD_BOOT_READS;
+}
+
 // ----------------------------------------------------------------------
 // Read and write (Note: The sector number starts with 0, not 1.)
 // ----------------------------------------------------------------------
-int md_access(uint8_t drive, uint8_t tr, uint8_t sec, uint8_t num_sec, uint8_t *buf, uint8_t rw) {
+// md_access() is made of the following steps. They can also be called one by
+// one to process a transfer sector by sector: md_begin(), md_sector() for
+// each sector, and md_end() or md_abort(). md_buf[drive] holds the track in
+// between, and md_lock[drive] is held from md_begin() to md_end() so that
+// accesses from other threads are serialized.
+static pthread_mutex_t md_lock[MAX_DRIVE];
+
+// Check the parameters, and load the track into the track buffer.
+// The lock is taken only if this succeeds with num_sec > 0.
+int md_begin(uint8_t drive, uint8_t tr, uint8_t sec, uint8_t num_sec, uint8_t rw) {
     assert(rw == 1 || rw == 2);
 
     if (!(drive < MAX_DRIVE)) {
@@ -119,70 +911,388 @@ int md_access(uint8_t drive, uint8_t tr, uint8_t sec, uint8_t num_sec, uint8_t *
         return -1;
     }
 
-    fseek(md_fp[drive], GET_4BYTE(md_hdr[drive].track_offset[tr]), SEEK_SET);
-    fread(md_buf[drive], sizeof(md_buf[drive]), 1, md_fp[drive]);
+    pthread_mutex_lock(&md_lock[drive]);
+    if (md_fp[drive] == NULL) {
+        // Closed while waiting for the lock
+        pthread_mutex_unlock(&md_lock[drive]);
+        return -1;
+    }
+    md_stat_access(drive, tr, sec, num_sec, rw);
+    if (rw == MD_READ) {
+        md_boot_record(drive, tr);
+    }
 
+    if (md_load_track(drive, tr)) {
+        pthread_mutex_unlock(&md_lock[drive]);
+        return -1;
+    }
+    return 0;
+}
+
+// Search a sector in a track
+static int md_search_sector(sector_t *track, uint8_t tr, int sec) {
     int c = tr / 2;
     int h = tr % 2;
+    int r = sec + 1;
     int n = 1;
+    for (int j = 0; j < NUM_SECTOR; j++) {
+        if (track[j].c == c && track[j].h == h && track[j].r == r && track[j].n == n) {
+            return j;
+        }
+    }
+    return -1; // No such sector
+}
+
+// Search a sector in the track buffer
+int md_find_sector(uint8_t drive, uint8_t tr, int sec) {
+    int j = md_search_sector(md_buf[drive], tr, sec);
+    if (j < 0) {
+        DP("Cannot find sector: Drive=%d C=%d H=%d R=%d N=%d.\n", drive, tr / 2, tr % 2, sec + 1, 1);
+    }
+    return j;
+}
+
+// Called for every sector read or written, e.g. to follow a file system
+void (*md_sector_hook)(uint8_t drive, uint8_t tr, int sec, const uint8_t *data, uint8_t rw);
+// Called when a disk is mounted or formatted, to forget what the hook has learned
+void (*md_media_hook)(uint8_t drive);
+
+// Copy a sector between the track buffer and buf
+int md_sector(uint8_t drive, uint8_t tr, int sec, uint8_t *buf, uint8_t rw) {
+    int j = md_find_sector(drive, tr, sec);
+    if (j < 0) {
+        return -1;
+    }
+    if (rw == MD_WRITE) {
+        DP("Write sector: ");
+        memcpy(md_buf[drive][j].data, buf, SECTOR_SIZE);
+    } else {
+        DP("Read sector: ");
+        memcpy(buf, md_buf[drive][j].data, SECTOR_SIZE);
+    }
+    DP("Drive=%d C=%d H=%d R=%d N=%d.\r", drive, tr / 2, tr % 2, sec + 1, 1);
+    md_stat_sector(drive, tr, sec, rw);
+    if (md_sector_hook) {
+        md_sector_hook(drive, tr, sec, buf, rw);
+    }
+    return 0;
+}
+
+// Write the track buffer back
+int md_end(uint8_t drive, uint8_t tr, uint8_t rw) {
+    DP("\n");
+    int ret = 0;
+    if (rw == MD_WRITE && md_store_track(drive, tr)) {
+        ret = -1;
+    } else {
+        md_fflush(drive);
+    }
+    pthread_mutex_unlock(&md_lock[drive]);
+    return ret;
+}
+
+// Give up the track buffer without writing it back
+void md_abort(uint8_t drive) {
+    pthread_mutex_unlock(&md_lock[drive]);
+}
+
+int md_access(uint8_t drive, uint8_t tr, uint8_t sec, uint8_t num_sec, uint8_t *buf, uint8_t rw) {
+    if (md_begin(drive, tr, sec, num_sec, rw)) {
+        return -1;
+    }
+
+    if (!num_sec) {
+        return 0;
+    }
+
     for (int i = 0; i < num_sec; i++) {
-        int r = sec + 1 + i;
-        // Search sector
-        int j;
-        for (j = 0; j < NUM_SECTOR; j++) {
-            if (md_buf[drive][j].c == c && md_buf[drive][j].h == h && md_buf[drive][j].r == r && md_buf[drive][j].n == n) {
-                break;
-            }
+        if (md_sector(drive, tr, sec + i, &buf[SECTOR_SIZE * i], rw)) {
+            md_abort(drive);
+            return -1;
         }
-        if (j == NUM_SECTOR) {
-            DP("Cannot find sector: Drive=%d C=%d H=%d R=%d N=%d.\n", drive, c, h, r, n);
-            return -1; // No such sector
+    }
+    return md_end(drive, tr, rw);
+}
+
+// ----------------------------------------------------------------------
+// Lock-free read for other threads
+// ----------------------------------------------------------------------
+// Read sectors from the image directly, retrying while the track is being
+// rewritten, so that this never blocks md_access(). The track version is
+// returned in version.
+int md_peek(uint8_t drive, uint8_t tr, uint8_t sec, uint8_t num_sec, uint8_t *buf, uint32_t *version) {
+    if (!(drive < MAX_DRIVE && md_fp[drive] != NULL && tr < NUM_TRACK)) {
+        return -1;
+    }
+
+    sector_t track[NUM_SECTOR];
+    uint32_t seq;
+    int ret;
+    do {
+        seq = __atomic_load_n(&md_track_seq[drive][tr], __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
         }
-        if (rw == MD_WRITE) {
-            DP("Write sector: ");
-            memcpy(md_buf[drive][j].data, &buf[SECTOR_SIZE * i], SECTOR_SIZE);
+        long ofs = GET_4BYTE(md_hdr[drive].track_offset[tr]);
+        md_zimg_t *z = md_zimg[drive];
+        if (z != NULL) {
+            md_zwait(z, ofs + sizeof(track));
+            ret = ofs + (long)sizeof(track) <= z->size;
+            if (ret) {
+                memcpy(track, z->dat + ofs, sizeof(track));
+            }
         } else {
-            DP("Read sector: ");
-            memcpy(&buf[SECTOR_SIZE * i], md_buf[drive][j].data, SECTOR_SIZE);
+            ret = pread(fileno(md_fp[drive]), track, sizeof(track), ofs) == sizeof(track);
         }
-        DP("Drive=%d C=%d H=%d R=%d N=%d.\r", drive, c, h, r, n);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&md_track_seq[drive][tr], __ATOMIC_RELAXED) != seq);
+
+    if (!ret) {
+        return -1;
     }
-    DP("\n");
-    if (rw == MD_WRITE) {
-        if (fseek(md_fp[drive], GET_4BYTE(md_hdr[drive].track_offset[tr]), SEEK_SET)) {
-            perror("Seek failed.");
-            return -1;
-        }
-        int ret = fwrite(md_buf[drive], sizeof(md_buf[drive]), 1, md_fp[drive]);
-        if (ret != 1) {
-            perror("Write failed.");
+    for (int i = 0; i < num_sec; i++) {
+        int j = md_search_sector(track, tr, sec + i);
+        if (j < 0) {
             return -1;
         }
+        memcpy(&buf[SECTOR_SIZE * i], track[j].data, SECTOR_SIZE);
     }
-
-    fflush(md_fp[drive]);
+    *version = seq;
     return 0;
 }
 
+// Current version of a track
+uint32_t md_track_version(uint8_t drive, uint8_t tr) {
+    return __atomic_load_n(&md_track_seq[drive][tr], __ATOMIC_ACQUIRE);
+}
+
 // ----------------------------------------------------------------------
-// Format disk image
+// Integrity scrubber
 // ----------------------------------------------------------------------
-int md_format(uint8_t drive) {
-    if (!(drive < MAX_DRIVE)) {
-        DP("Illegal drive: %d\n", drive);
-        return -1;
+// A background thread re-reads every track from the media, bypassing the page
+// cache, and compares it with its checksum. It runs at idle priority on the
+// last CPU, and waits while a command is in flight (see md_scrub_hold()) and
+// for MD_SCRUB_QUIET ms after it. The protocol thread busy-polls GPIO, so it
+// is pinned to MD_PROTOCOL_CPU (see md_pin_protocol()), away from the scrubber.
+#define MD_CRC_MAGIC "MDCK"
+#define MD_SCRUB_PERIOD 600 // Seconds between passes
+#define MD_SCRUB_PACE 20    // Milliseconds between tracks
+#define MD_SCRUB_QUIET 100  // Milliseconds after the last command
+#define MD_PROTOCOL_CPU 0
+
+typedef struct {
+    char magic[4];
+    uint8_t reserve[4];
+    int64_t mtime_sec; // Of the image, when saved
+    int64_t mtime_nsec;
+    uint32_t crc[NUM_TRACK];
+    uint8_t state[NUM_TRACK];
+} md_crc_file_t;
+
+static int md_scrub_busy;
+static uint64_t md_scrub_idle_since;
+static pthread_once_t md_scrub_once = PTHREAD_ONCE_INIT;
+
+// Called by the protocol side when a command starts (1) and ends (0)
+void md_scrub_hold(int busy) {
+    if (!busy) {
+        __atomic_store_n(&md_scrub_idle_since, md_clock_ns(CLOCK_MONOTONIC), __ATOMIC_RELAXED);
     }
+    __atomic_store_n(&md_scrub_busy, busy, __ATOMIC_RELEASE);
+}
 
-    if (!(md_fp[drive] != NULL)) {
-        DP("No disk: %d\n", drive);
-        return -1;
+int md_crc_save(uint8_t drive) {
+    md_crc_file_t f;
+    ZEROFILL(f);
+    memcpy(f.magic, MD_CRC_MAGIC, sizeof(f.magic));
+
+    // Take the checksums and the time stamp of the image together.
+    pthread_mutex_lock(&md_cache_lock[drive]);
+    struct stat st;
+    if (!md_crc_on[drive] || !md_crc_dirty[drive] || md_fp[drive] == NULL || fstat(fileno(md_fp[drive]), &st)) {
+        pthread_mutex_unlock(&md_cache_lock[drive]);
+        return 0;
     }
+    f.mtime_sec = st.st_mtim.tv_sec;
+    f.mtime_nsec = st.st_mtim.tv_nsec;
+    memcpy(f.crc, md_crc[drive], sizeof(f.crc));
+    for (int tr = 0; tr < NUM_TRACK; tr++) {
+        f.state[tr] = md_crc_state[drive][tr] != MD_CRC_NONE;
+    }
+    md_crc_dirty[drive] = 0;
+    char path[strlen(md_fname[drive]) + 5];
+    sprintf(path, "%s.crc", md_fname[drive]);
+    pthread_mutex_unlock(&md_cache_lock[drive]);
 
-    if (md_hdr[drive].write_protect) {
-        DP("Write protected.");
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "MD88: Cannot create [%s]\n", path);
+        return -1;
+    }
+    int ret = fwrite(&f, sizeof(f), 1, fp);
+    if (fclose(fp) || ret != 1) {
+        fprintf(stderr, "MD88: Write failed [%s]\n", path);
         return -1;
     }
+    return 0;
+}
+
+// Load the checksums, unless the image has been modified since they were saved
+void md_crc_load(uint8_t drive) {
+    char path[strlen(md_fname[drive]) + 5];
+    sprintf(path, "%s.crc", md_fname[drive]);
+    md_crc_file_t f;
+    ZEROFILL(f);
+    FILE *fp = fopen(path, "r");
+    if (fp != NULL) {
+        struct stat st;
+        int ret = fread(&f, sizeof(f), 1, fp);
+        fclose(fp);
+        if (ret != 1 || memcmp(f.magic, MD_CRC_MAGIC, sizeof(f.magic)) || fstat(fileno(md_fp[drive]), &st) ||
+            f.mtime_sec != st.st_mtim.tv_sec || f.mtime_nsec != st.st_mtim.tv_nsec) {
+            DP("MD88: Ignore checksums [%s]\n", path);
+            ZEROFILL(f);
+        }
+    }
+
+    pthread_mutex_lock(&md_cache_lock[drive]);
+    md_crc_gen[drive]++;
+    md_crc_on[drive] = md_zimg[drive] == NULL;
+    md_crc_dirty[drive] = 0;
+    memcpy(md_crc[drive], f.crc, sizeof(f.crc));
+    for (int tr = 0; tr < NUM_TRACK; tr++) {
+        md_crc_state[drive][tr] = f.state[tr] ? MD_CRC_OK : MD_CRC_NONE;
+    }
+    pthread_mutex_unlock(&md_cache_lock[drive]);
+}
+
+// Wait until no command has been in flight for a while
+static void md_scrub_wait() {
+    while (__atomic_load_n(&md_scrub_busy, __ATOMIC_ACQUIRE) ||
+           md_clock_ns(CLOCK_MONOTONIC) - __atomic_load_n(&md_scrub_idle_since, __ATOMIC_RELAXED) < MD_SCRUB_QUIET * 1000000ULL) {
+        __atomic_add_fetch(&md_scrub_stat.yields, 1, __ATOMIC_RELAXED);
+        usleep(MD_SCRUB_QUIET * 1000);
+    }
+}
+
+// Verify a track. Returns 1 if the track has been read.
+static int md_scrub_track(uint8_t drive, uint8_t tr) {
+    // The image is read through a duplicated descriptor, so that it can be
+    // closed in the meantime.
+    pthread_mutex_lock(&md_cache_lock[drive]);
+    int fd = md_crc_on[drive] && md_fp[drive] != NULL ? dup(fileno(md_fp[drive])) : -1;
+    uint32_t gen = md_crc_gen[drive];
+    uint32_t seq = md_track_seq[drive][tr];
+    long ofs = GET_4BYTE(md_hdr[drive].track_offset[tr]);
+    pthread_mutex_unlock(&md_cache_lock[drive]);
+    if (fd < 0) {
+        return 0;
+    }
+
+    sector_t track[NUM_SECTOR];
+    posix_fadvise(fd, ofs, sizeof(track), POSIX_FADV_DONTNEED);
+    int ret = ofs && pread(fd, track, sizeof(track), ofs) == sizeof(track);
+    close(fd);
+    if (!ret) {
+        return 0;
+    }
+
+    // Compare unless the track has been rewritten in the meantime
+    pthread_mutex_lock(&md_cache_lock[drive]);
+    if (md_fp[drive] != NULL && md_crc_gen[drive] == gen && md_track_seq[drive][tr] == seq) {
+        md_crc_check(drive, tr, track, &md_scrub_stat.bad);
+    }
+    pthread_mutex_unlock(&md_cache_lock[drive]);
+    __atomic_add_fetch(&md_scrub_stat.tracks, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Pin the calling thread to a CPU, if there are more than one
+static void md_pin_cpu(long cpu) {
+#ifdef CPU_SET
+    if (sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#else
+    (void)cpu;
+#endif
+}
+
+// Called by the protocol thread. Threads it creates afterwards would inherit
+// the CPU, so this comes after the other threads have been started.
+void md_pin_protocol() {
+    md_pin_cpu(MD_PROTOCOL_CPU);
+}
+
+void *md_scrub_main(void *arg) {
+    // The last CPU, which is never MD_PROTOCOL_CPU on a multi-core system
+    md_pin_cpu(sysconf(_SC_NPROCESSORS_ONLN) - 1);
+#ifdef SCHED_IDLE
+    struct sched_param param;
+    ZEROFILL(param);
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+    while (1) {
+        for (int drive = 0; drive < MAX_DRIVE; drive++) {
+            for (int tr = 0; tr < NUM_TRACK; tr++) {
+                md_scrub_wait();
+                uint64_t t = md_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+                int done = md_scrub_track(drive, tr);
+                __atomic_add_fetch(&md_scrub_stat.cpu_ns, md_clock_ns(CLOCK_THREAD_CPUTIME_ID) - t, __ATOMIC_RELAXED);
+                if (done) {
+                    usleep(MD_SCRUB_PACE * 1000);
+                }
+            }
+            md_crc_save(drive);
+        }
+        __atomic_add_fetch(&md_scrub_stat.passes, 1, __ATOMIC_RELAXED);
+        sleep(MD_SCRUB_PERIOD);
+    }
+    return NULL;
+}
+
+static void md_scrub_start() {
+    pthread_t th;
+    if (pthread_create(&th, NULL, md_scrub_main, NULL) == 0) {
+        pthread_detach(th);
+    }
+}
+
+#define MD_SCRUB_STAT(f) __atomic_load_n(&md_scrub_stat.f, __ATOMIC_RELAXED)
+
+// Write the scrubber statistics in JSON
+void md_scrub_json(FILE *fp) {
+    fprintf(fp, "{\"passes\":%llu,\"tracks\":%llu,\"mismatches\":%llu,\"yields\":%llu,\"cpu_us\":%llu,",
+            (unsigned long long)MD_SCRUB_STAT(passes), (unsigned long long)MD_SCRUB_STAT(tracks),
+            (unsigned long long)MD_SCRUB_STAT(bad), (unsigned long long)MD_SCRUB_STAT(yields),
+            (unsigned long long)MD_SCRUB_STAT(cpu_ns) / 1000);
+    fprintf(fp, "\"verified\":%llu,\"verify_us\":%llu,\"verify_mismatches\":%llu}",
+            (unsigned long long)MD_SCRUB_STAT(verified), (unsigned long long)MD_SCRUB_STAT(verify_ns) / 1000,
+            (unsigned long long)MD_SCRUB_STAT(verify_bad));
+}
+
+// Print the scrubber overhead
+void md_scrub_report(FILE *fp) {
+    uint64_t tracks = MD_SCRUB_STAT(tracks), verified = MD_SCRUB_STAT(verified);
+    fprintf(fp, "Scrub: %llu passes, %llu tracks, %llu mismatches, %llu yields, CPU %.1f ms (%.1f us/track)\n",
+            (unsigned long long)MD_SCRUB_STAT(passes), (unsigned long long)tracks, (unsigned long long)MD_SCRUB_STAT(bad),
+            (unsigned long long)MD_SCRUB_STAT(yields), MD_SCRUB_STAT(cpu_ns) / 1e6,
+            tracks ? MD_SCRUB_STAT(cpu_ns) / 1e3 / tracks : 0.0);
+    if (md_verify) {
+        fprintf(fp, "Verify: %llu tracks, %llu mismatches, %.1f us/track\n", (unsigned long long)verified,
+                (unsigned long long)MD_SCRUB_STAT(verify_bad), verified ? MD_SCRUB_STAT(verify_ns) / 1e3 / verified : 0.0);
+    }
+}
 
+// ----------------------------------------------------------------------
+// Format disk image
+// ----------------------------------------------------------------------
+static int md_format_image(uint8_t drive) {
     int ret;
 
     ZEROFILL(md_hdr[drive]);
@@ -190,11 +1300,11 @@ int md_format(uint8_t drive) {
     for (int i = 0; i < NUM_TRACK; i++) {
         SET_4BYTE(md_hdr[drive].track_offset[i], sizeof(disk_hdr_t) + sizeof(sector_t) * NUM_SECTOR * i);
     }
-    if (fseek(md_fp[drive], 0, SEEK_SET)) {
+    if (md_seek(drive, 0)) {
         perror("Format: seek failed.");
         return -1;
     }
-    ret = fwrite((void *)&md_hdr[drive], sizeof(md_hdr[drive]), 1, md_fp[drive]);
+    ret = md_fwrite(drive, (void *)&md_hdr[drive], sizeof(md_hdr[drive]));
     if (ret != 1) {
         perror("Format: write failed.");
         return -1;
@@ -212,29 +1322,99 @@ int md_format(uint8_t drive) {
             SET_2BYTE(md_buf[drive][j].size, SECTOR_SIZE);
             DP("Drive=%d C=%d H=%d R=%d N=%d.\n", drive, md_buf[drive][j].c, md_buf[drive][j].h, md_buf[drive][j].r, md_buf[drive][j].n);
         }
-        ret = fwrite(md_buf[drive], sizeof(md_buf[drive]), 1, md_fp[drive]);
+        ret = md_fwrite(drive, md_buf[drive], sizeof(md_buf[drive]));
         if (ret != 1) {
             perror("Write failed.");
             return -1;
         }
+        md_crc_set(drive, i, md_buf[drive]);
     }
 
-    fflush(md_fp[drive]);
+    md_fflush(drive);
     return 0;
 }
 
+int md_format(uint8_t drive) {
+    if (!(drive < MAX_DRIVE)) {
+        DP("Illegal drive: %d\n", drive);
+        return -1;
+    }
+
+    if (!(md_fp[drive] != NULL)) {
+        DP("No disk: %d\n", drive);
+        return -1;
+    }
+
+    if (md_hdr[drive].write_protect) {
+        DP("Write protected.");
+        return -1;
+    }
+
+    // The whole image is rewritten.
+    pthread_mutex_lock(&md_lock[drive]);
+    if (md_fp[drive] == NULL) {
+        pthread_mutex_unlock(&md_lock[drive]);
+        return -1;
+    }
+    pthread_mutex_lock(&md_cache_lock[drive]);
+    for (int i = 0; i < NUM_TRACK; i++) {
+        md_seq_begin(drive, i);
+    }
+    memset(md_cached[drive], 0, sizeof(md_cached[drive]));
+
+    int ret = md_format_image(drive);
+    if (md_media_hook) {
+        md_media_hook(drive);
+    }
+
+    for (int i = 0; i < NUM_TRACK; i++) {
+        md_seq_end(drive, i);
+    }
+    pthread_mutex_unlock(&md_cache_lock[drive]);
+    pthread_mutex_unlock(&md_lock[drive]);
+    return ret;
+}
+
 // ======================================================================
 // Initialize and finalize
 // ======================================================================
+#define MD_CLOSE_WAIT 2 // sec
+
+// The image is closed under md_lock, so that no other thread is accessing it.
+// A transfer that the PC has left half done holds the lock for good, and then
+// the drive is left open after MD_CLOSE_WAIT seconds.
 void md_close(uint8_t drive) {
     if (md_fp[drive] == NULL) {
         return;
     }
-    fclose(md_fp[drive]);
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_sec += MD_CLOSE_WAIT;
+    if (pthread_mutex_timedlock(&md_lock[drive], &t)) {
+        fprintf(stderr, "MD88: Drive %d is busy, left open\n", drive);
+        return;
+    }
+    md_boot_stop(drive);
+    md_crc_save(drive);
+
+    // Stop prefetching before the image goes away
+    pthread_mutex_lock(&md_cache_lock[drive]);
+    FILE *fp = md_fp[drive];
     md_fp[drive] = NULL;
+    md_crc_on[drive] = 0;
+    memset(md_cached[drive], 0, sizeof(md_cached[drive]));
+    pthread_mutex_unlock(&md_cache_lock[drive]);
+
+    md_zclose(drive);
+    fclose(fp);
+    free(md_fname[drive]);
+    md_fname[drive] = NULL;
+    pthread_mutex_unlock(&md_lock[drive]);
 }
 
-int md_open(uint8_t drive, char *fname) {
+// Open a disk image. If hdr is given, it is used instead of the header in the
+// image, e.g. one taken from a catalog.
+int md_open_hdr(uint8_t drive, char *fname, const disk_hdr_t *hdr) {
     assert(drive < MAX_DRIVE);
     assert(fname != NULL);
 
@@ -245,34 +1425,67 @@ int md_open(uint8_t drive, char *fname) {
         fprintf(stderr, "MD88: Cannot open [%s]\n", fname);
         return -1;
     }
+    md_fname[drive] = strdup(fname);
+
+    long size;
+    if (md_is_gzip(fp)) {
+        DP("Compressed disk\n");
+        if (md_zopen(drive, fname)) {
+            md_close(drive);
+            return -1;
+        }
+        size = md_zimg[drive]->avail;
+    } else {
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+    }
 
-    fseek(fp, 0, SEEK_END);
-    if (ftell(fp) == 0) {
+    md_crc_load(drive);
+    pthread_once(&md_scrub_once, md_scrub_start);
+    if (md_media_hook) {
+        md_media_hook(drive);
+    }
+
+    if (size == 0) {
         DP("New disk\n");
     } else {
-        fseek(fp, 0, SEEK_SET);
-        fread(&md_hdr[drive], sizeof(disk_hdr_t), 1, fp);
+        if (hdr != NULL) {
+            md_hdr[drive] = *hdr;
+        } else {
+            md_seek(drive, 0);
+            md_fread(drive, &md_hdr[drive], sizeof(disk_hdr_t));
+        }
 
         DP("Disk=[%s]\n", md_hdr[drive].disk);
         DP("Disk Size=%d\n", md_hdr[drive].disk_size);
         DP("Track0 ofs=%x\n", md_hdr[drive].track_offset[0]);
+
+        md_boot_start(drive);
     }
 
     return 0;
 }
 
+int md_open(uint8_t drive, char *fname) {
+    return md_open_hdr(drive, fname, NULL);
+}
+
 void MD_Quit() {
     for (int i = 0; i < MAX_DRIVE; i++) {
-        if (md_fp[i] == NULL) {
-            continue;
-        }
-        fclose(md_fp[i]);
+        md_close(i);
     }
+    md_scrub_report(stdout);
 }
 
 void MD_Init() {
+    md_crc_init();
     for (int i = 0; i < MAX_DRIVE; i++) {
         md_fp[i] = NULL;
+        md_zimg[i] = NULL;
+        md_fname[i] = NULL;
+        md_boot_reads[i] = MD_BOOT_READS;
+        pthread_mutex_init(&md_lock[i], NULL);
+        pthread_mutex_init(&md_cache_lock[i], NULL);
     }
 }
 
@@ -0,0 +1,117 @@
+//
+// N88-DISK BASIC Library
+//
+#ifndef __MN88_H_
+#define __MN88_H_
+
+#include "MD88.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ======================================================================
+// N88-DISK BASIC 2D disk layout
+// ======================================================================
+// Track 37 (cylinder 18, head 1) holds the directory in sector 1-12, and three
+// copies of the FAT in sector 14-16. A cluster is a half track (8 sectors).
+// A FAT entry is the next cluster of the chain, 0xc1-0xc8 for the last cluster
+// (the low bits are the number of sectors used), 0xfe reserved or 0xff free.
+// A directory entry is 16 bytes: name(6), ext(3), attribute(1), the first
+// cluster(1) and reserved(5). The first byte is 0x00 if the file is deleted,
+// and 0xff if the entry has never been used.
+#define N88_DIR_TRACK 37
+#define N88_DIR_SECTORS 12 // The sector number starts with 0.
+#define N88_FAT_SECTOR 13
+#define N88_NUM_CLUSTER 160
+#define N88_CLUSTER_SECTORS 8
+#define N88_DIR_ENTRY_SIZE 16
+#define N88_DIR_ENTRIES (SECTOR_SIZE / N88_DIR_ENTRY_SIZE)
+#define N88_DIR_CLUSTER 10 // Offset of the first cluster in a directory entry
+#define N88_NO_CLUSTER 0xff
+
+typedef struct {
+    uint8_t fat_valid;
+    uint8_t fat[N88_NUM_CLUSTER];
+    uint8_t dir_start[N88_DIR_SECTORS][N88_DIR_ENTRIES]; // First cluster of each entry
+    uint8_t head[N88_NUM_CLUSTER];                        // The cluster starts a file
+} n88_fs_t;
+
+static n88_fs_t n88_fs[MAX_DRIVE];
+
+// ======================================================================
+// File-aware prefetch
+// ======================================================================
+// The FAT and the directory are parsed as they pass through md_sector(), in
+// either direction. When the PC reads the first sector of a file, the rest of
+// its cluster chain is queued for prefetch.
+static void n88_update_dir(n88_fs_t *fs, int sec, const uint8_t *data) {
+    for (int i = 0; i < N88_DIR_ENTRIES; i++) {
+        const uint8_t *e = &data[N88_DIR_ENTRY_SIZE * i];
+        fs->dir_start[sec][i] = (e[0] == 0x00 || e[0] == 0xff) ? N88_NO_CLUSTER : e[N88_DIR_CLUSTER];
+    }
+
+    memset(fs->head, 0, sizeof(fs->head));
+    for (int s = 0; s < N88_DIR_SECTORS; s++) {
+        for (int i = 0; i < N88_DIR_ENTRIES; i++) {
+            if (fs->dir_start[s][i] < N88_NUM_CLUSTER) {
+                fs->head[fs->dir_start[s][i]] = 1;
+            }
+        }
+    }
+}
+
+static void n88_prefetch_file(uint8_t drive, n88_fs_t *fs, int c) {
+    int last_tr = c / 2; // Being read now
+    int n = 0;
+    DP("N88: Prefetch file from cluster %d\n", c);
+    // Guard against a broken chain with a loop
+    for (c = fs->fat[c]; c < N88_NUM_CLUSTER && n < N88_NUM_CLUSTER; c = fs->fat[c], n++) {
+        if (c / 2 != last_tr) {
+            last_tr = c / 2;
+            md_prefetch(drive, last_tr);
+        }
+    }
+}
+
+void n88_sector_hook(uint8_t drive, uint8_t tr, int sec, const uint8_t *data, uint8_t rw) {
+    n88_fs_t *fs = &n88_fs[drive];
+
+    if (tr == N88_DIR_TRACK) {
+        if (sec == N88_FAT_SECTOR) {
+            memcpy(fs->fat, data, sizeof(fs->fat));
+            fs->fat_valid = 1;
+        } else if (sec < N88_DIR_SECTORS) {
+            n88_update_dir(fs, sec, data);
+        }
+        return;
+    }
+
+    int c = tr * 2 + sec / N88_CLUSTER_SECTORS;
+    if (rw == MD_READ && fs->fat_valid && sec % N88_CLUSTER_SECTORS == 0 && c < N88_NUM_CLUSTER && fs->head[c]) {
+        n88_prefetch_file(drive, fs, c);
+    }
+}
+
+// A new or formatted disk: Nothing is known until the FAT is read again.
+void n88_media_hook(uint8_t drive) {
+    ZEROFILL(n88_fs[drive]);
+    memset(n88_fs[drive].dir_start, N88_NO_CLUSTER, sizeof(n88_fs[drive].dir_start));
+}
+
+// ======================================================================
+// Initialize
+// ======================================================================
+void MN88_Init() {
+    for (int i = 0; i < MAX_DRIVE; i++) {
+        n88_media_hook(i);
+    }
+    md_sector_hook = n88_sector_hook;
+    md_media_hook = n88_media_hook;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __MN88_H_
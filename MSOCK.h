@@ -0,0 +1,199 @@
+//
+// Sector access server
+//
+#ifndef __MSOCK_H_
+#define __MSOCK_H_
+
+#include "MD88.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ======================================================================
+// Protocol
+// ======================================================================
+// Other processes read and write sectors of the mounted drives through a
+// UNIX domain socket (SOCK_STREAM). A client sends requests one by one, and
+// each gets a response.
+//
+// Request:  msock_req_t, followed by num_sec * 256 bytes for MSOCK_WRITE.
+// Response: msock_res_t, followed by num_sec * 256 bytes for a successful
+//           MSOCK_READ.
+//
+// Reads never block the emulator. They retry while the track is being
+// rewritten, and return a consistent snapshot of the track. Writes go
+// through md_write(), serialized with the emulator's own accesses.
+// The version is the track version after the access. It is even, and
+// changes whenever the track is rewritten.
+#define MSOCK_READ 'R'
+#define MSOCK_WRITE 'W'
+
+typedef struct {
+    uint8_t op;
+    uint8_t drive;
+    uint8_t tr;
+    uint8_t sec; // Starts with 1
+    uint8_t num_sec;
+    uint8_t reserve[3];
+} msock_req_t;
+
+typedef struct {
+    int8_t status; // 0: OK, -1: Error
+    uint8_t reserve[3];
+    uint8_t version[4];
+} msock_res_t;
+
+// ======================================================================
+// Server
+// ======================================================================
+static int msock_read_full(int fd, void *p, size_t len) {
+    for (size_t n = 0; n < len;) {
+        ssize_t ret = read(fd, (uint8_t *)p + n, len - n);
+        if (ret <= 0) {
+            return -1;
+        }
+        n += ret;
+    }
+    return 0;
+}
+
+static int msock_write_full(int fd, const void *p, size_t len) {
+    for (size_t n = 0; n < len;) {
+        ssize_t ret = send(fd, (const uint8_t *)p + n, len - n, MSG_NOSIGNAL);
+        if (ret <= 0) {
+            return -1;
+        }
+        n += ret;
+    }
+    return 0;
+}
+
+void *msock_client(void *arg) {
+    int fd = (intptr_t)arg;
+    msock_req_t req;
+    uint8_t buf[SECTOR_SIZE * NUM_SECTOR];
+
+    while (msock_read_full(fd, &req, sizeof(req)) == 0) {
+        msock_res_t res;
+        ZEROFILL(res);
+        uint32_t version = 0;
+        int sec = req.sec - 1; // Translate sector number.
+        int ok = req.drive < MAX_DRIVE && req.tr < NUM_TRACK && sec >= 0 && req.num_sec <= NUM_SECTOR;
+
+        if (req.op == MSOCK_WRITE) {
+            // The data of a request too large for buf cannot be skipped
+            // safely, so the client is dropped.
+            if (req.num_sec > NUM_SECTOR) {
+                DP("MSOCK: Too many sectors: %d\n", req.num_sec);
+                break;
+            }
+            if (msock_read_full(fd, buf, SECTOR_SIZE * req.num_sec)) {
+                break;
+            }
+            DP("MSOCK: Write drive=%d tr=%d sec=%d num_sec=%d\n", req.drive, req.tr, req.sec, req.num_sec);
+            ok = ok && md_write(req.drive, req.tr, sec, req.num_sec, buf) == 0;
+            if (ok) {
+                version = md_track_version(req.drive, req.tr);
+            }
+        } else if (req.op == MSOCK_READ) {
+            ok = ok && md_peek(req.drive, req.tr, sec, req.num_sec, buf, &version) == 0;
+        } else {
+            ok = 0;
+        }
+
+        res.status = ok ? 0 : -1;
+        SET_4BYTE(res.version, version);
+        if (msock_write_full(fd, &res, sizeof(res))) {
+            break;
+        }
+        if (ok && req.op == MSOCK_READ && msock_write_full(fd, buf, SECTOR_SIZE * req.num_sec)) {
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+void *msock_server(void *arg) {
+    int sock = (intptr_t)arg;
+    while (1) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            perror("MSOCK: Accept failed.");
+            continue;
+        }
+        pthread_t th;
+        if (pthread_create(&th, NULL, msock_client, (void *)(intptr_t)fd)) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(th);
+    }
+    return NULL;
+}
+
+// ======================================================================
+// Initialize
+// ======================================================================
+// The emulator runs as root, so the socket is given the mode, and the group of
+// the user who ran sudo, for the tools of that user to connect.
+#define MSOCK_MODE 0660
+
+int MSOCK_Init(const char *path, mode_t mode) {
+    struct sockaddr_un addr;
+    ZEROFILL(addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "MSOCK: Too long path [%s]\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("MSOCK: Cannot create socket.");
+        return -1;
+    }
+    // Remove the socket left by the last run, but never any other file.
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "MSOCK: Not a socket [%s]\n", path);
+            close(sock);
+            return -1;
+        }
+        unlink(path);
+    }
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("MSOCK: Cannot bind.");
+        close(sock);
+        return -1;
+    }
+    const char *gid = getenv("SUDO_GID");
+    if ((gid != NULL && chown(path, -1, atoi(gid))) || chmod(path, mode) || listen(sock, 4)) {
+        perror("MSOCK: Cannot listen.");
+        close(sock);
+        unlink(path);
+        return -1;
+    }
+
+    pthread_t th;
+    if (pthread_create(&th, NULL, msock_server, (void *)(intptr_t)sock)) {
+        perror("MSOCK: Cannot create thread.");
+        close(sock);
+        return -1;
+    }
+    pthread_detach(th);
+    printf("Sector access server listening on [%s] (mode %04o)\n", path, (unsigned)mode);
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __MSOCK_H_
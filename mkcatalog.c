@@ -0,0 +1,292 @@
+//
+// d88 catalog builder
+//
+#define _GNU_SOURCE // nftw(), realpath()
+
+#include "MD88.h"
+#include "MCAT.h"
+
+#include <ftw.h>
+#include <strings.h>
+#include <limits.h>
+
+#define CATALOG_FILE "catalog.mcat"
+#define HASH_CHUNK 65536
+
+typedef struct {
+    mcat_entry_t e;
+    char *path;
+    int ok;
+} item_t;
+
+static item_t *items;
+static int num_items, max_items;
+static int next_item;
+static int num_reused;
+static mcat_t old_cat;
+static const mcat_entry_t **old_by_path;
+
+// ======================================================================
+// Scan directories
+// ======================================================================
+static int is_image(const char *path) {
+    static const char *ext[] = {".d88", ".d88.gz"};
+    size_t len = strlen(path);
+    for (size_t i = 0; i < sizeof(ext) / sizeof(ext[0]); i++) {
+        size_t n = strlen(ext[i]);
+        if (len > n && strcasecmp(path + len - n, ext[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int add_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    if (type != FTW_F || !is_image(path)) {
+        return 0;
+    }
+    char *real = realpath(path, NULL);
+    if (real == NULL) {
+        return 0;
+    }
+    if (num_items == max_items) {
+        max_items = MAX(256, max_items * 2);
+        items = realloc(items, sizeof(item_t) * max_items);
+        assert(items != NULL);
+    }
+    memset(&items[num_items], 0, sizeof(item_t));
+    items[num_items++].path = real;
+    return 0;
+}
+
+// ======================================================================
+// Index an image
+// ======================================================================
+static int cmp_old_path(const void *a, const void *b) {
+    const mcat_entry_t *x = *(const mcat_entry_t **)a;
+    const mcat_entry_t *y = *(const mcat_entry_t **)b;
+    return strcmp(mcat_path(&old_cat, x), mcat_path(&old_cat, y));
+}
+
+// Entry of the previous catalog for an unchanged file
+static const mcat_entry_t *find_old(const char *path, const struct stat *st) {
+    int lo = 0, hi = old_cat.map != NULL ? (int)old_cat.hdr->num - 1 : -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int c = strcmp(mcat_path(&old_cat, old_by_path[mid]), path);
+        if (c == 0) {
+            const mcat_entry_t *e = old_by_path[mid];
+            return e->size == st->st_size && e->mtime == st->st_mtime ? e : NULL;
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+// Read the header, and hash the whole image. gzread() reads uncompressed files as they are.
+static int index_image(item_t *it) {
+    struct stat st;
+    if (stat(it->path, &st)) {
+        return -1;
+    }
+    const mcat_entry_t *old = find_old(it->path, &st);
+    if (old != NULL) {
+        it->e = *old;
+        __atomic_add_fetch(&num_reused, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    gzFile gz = gzopen(it->path, "rb");
+    if (gz == NULL) {
+        return -1;
+    }
+    static __thread uint8_t buf[HASH_CHUNK];
+    disk_hdr_t hdr;
+    uint64_t h = MD_HASH_INIT;
+    int n = gzread(gz, buf, sizeof(buf));
+    if (n < (int)sizeof(hdr)) {
+        gzclose(gz);
+        return -1;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    for (; n > 0; n = gzread(gz, buf, sizeof(buf))) {
+        h = md_hash(buf, n, h);
+    }
+    int ret = n == 0 ? 0 : -1;
+    gzclose(gz);
+    if (ret) {
+        return -1;
+    }
+
+    mcat_entry_t *e = &it->e;
+    e->hash = h;
+    e->mtime = st.st_mtime;
+    e->size = st.st_size;
+    memcpy(e->disk, hdr.disk, sizeof(e->disk));
+    e->disk[sizeof(e->disk) - 1] = '\0';
+    e->hdr = hdr;
+    return 0;
+}
+
+static void *worker(void *arg) {
+    (void)arg;
+    int i;
+    while ((i = __atomic_fetch_add(&next_item, 1, __ATOMIC_RELAXED)) < num_items) {
+        items[i].ok = index_image(&items[i]) == 0;
+        if (!items[i].ok) {
+            fprintf(stderr, "Skip [%s]\n", items[i].path);
+        }
+    }
+    return NULL;
+}
+
+// ======================================================================
+// Write the catalog
+// ======================================================================
+static int cmp_hash(const void *a, const void *b) {
+    const item_t *x = a, *y = b;
+    if (x->e.hash != y->e.hash) {
+        return x->e.hash < y->e.hash ? -1 : 1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+static int cmp_name(const void *a, const void *b) {
+    const item_t *x = &items[*(const uint32_t *)a], *y = &items[*(const uint32_t *)b];
+    int c = strncmp(x->e.disk, y->e.disk, sizeof(x->e.disk));
+    return c ? c : strcmp(x->path, y->path);
+}
+
+static int write_catalog(const char *fname) {
+    // Drop failures, and order by hash.
+    int num = 0;
+    for (int i = 0; i < num_items; i++) {
+        if (items[i].ok) {
+            items[num++] = items[i];
+        } else {
+            free(items[i].path);
+        }
+    }
+    num_items = num;
+    qsort(items, num, sizeof(item_t), cmp_hash);
+
+    uint32_t *name_index = malloc(sizeof(uint32_t) * MAX(num, 1));
+    assert(name_index != NULL);
+    uint32_t strings_size = 0;
+    for (int i = 0; i < num; i++) {
+        name_index[i] = i;
+        items[i].e.path = strings_size;
+        strings_size += strlen(items[i].path) + 1;
+    }
+    qsort(name_index, num, sizeof(uint32_t), cmp_name);
+
+    mcat_hdr_t hdr;
+    ZEROFILL(hdr);
+    memcpy(hdr.magic, MCAT_MAGIC, sizeof(hdr.magic));
+    hdr.version = MCAT_VERSION;
+    hdr.num = num;
+    hdr.name_index = sizeof(hdr) + sizeof(mcat_entry_t) * num;
+    hdr.strings = hdr.name_index + sizeof(uint32_t) * num;
+    hdr.strings_size = strings_size;
+
+    // Replace the catalog at once, so that a running emulator keeps its mapping.
+    char tmp[strlen(fname) + 5];
+    sprintf(tmp, "%s.tmp", fname);
+    FILE *fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot create [%s]\n", tmp);
+        free(name_index);
+        return -1;
+    }
+    int ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    for (int i = 0; ok && i < num; i++) {
+        ok = fwrite(&items[i].e, sizeof(mcat_entry_t), 1, fp) == 1;
+    }
+    ok = ok && (num == 0 || fwrite(name_index, sizeof(uint32_t) * num, 1, fp) == 1);
+    for (int i = 0; ok && i < num; i++) {
+        ok = fwrite(items[i].path, strlen(items[i].path) + 1, 1, fp) == 1;
+    }
+    free(name_index);
+    if (fclose(fp) || !ok) {
+        fprintf(stderr, "Write failed [%s]\n", tmp);
+        unlink(tmp);
+        return -1;
+    }
+    if (rename(tmp, fname)) {
+        perror("Rename failed.");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// ======================================================================
+// Main
+// ======================================================================
+int main(int argc, char *argv[]) {
+    const char *out = CATALOG_FILE;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "o:j:")) != -1) {
+        switch (opt) {
+        case 'o':
+            out = optarg;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        default:
+            optind = argc; // Show usage
+        }
+    }
+    if (optind >= argc) {
+        printf("Usage: %s [-o catalog] [-j jobs] dir [dir...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    jobs = MAX(jobs, 1);
+
+    // Unchanged files are taken from the previous catalog.
+    if (access(out, F_OK) == 0 && mcat_open(&old_cat, out) == 0) {
+        int num = old_cat.hdr->num;
+        old_by_path = malloc(sizeof(mcat_entry_t *) * MAX(num, 1));
+        assert(old_by_path != NULL);
+        for (int i = 0; i < num; i++) {
+            old_by_path[i] = &old_cat.entry[i];
+        }
+        qsort(old_by_path, num, sizeof(mcat_entry_t *), cmp_old_path);
+    }
+
+    for (int i = optind; i < argc; i++) {
+        if (nftw(argv[i], add_file, 16, FTW_PHYS)) {
+            fprintf(stderr, "Cannot scan [%s]\n", argv[i]);
+        }
+    }
+
+    pthread_t th[jobs];
+    for (int i = 0; i < jobs; i++) {
+        pthread_create(&th[i], NULL, worker, NULL);
+    }
+    for (int i = 0; i < jobs; i++) {
+        pthread_join(th[i], NULL);
+    }
+
+    int found = num_items;
+    int ret = write_catalog(out);
+    if (ret == 0) {
+        printf("Cataloged %d of %d images (%d unchanged) into [%s]\n", num_items, found, num_reused, out);
+    }
+
+    for (int i = 0; i < num_items; i++) {
+        free(items[i].path);
+    }
+    free(items);
+    free(old_by_path);
+    mcat_close(&old_cat);
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
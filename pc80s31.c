@@ -2,8 +2,15 @@
 // PC-80S31 emulator by Minatsu
 // 7-Apr-2021
 //
+#define _GNU_SOURCE // SCHED_IDLE and CPU affinity for the scrubber in MD88.h
+
 #include "MGPIO.h"
 #include "MD88.h"
+#include "MN88.h"
+#include "MSOCK.h"
+#include "MCAT.h"
+
+#include <time.h>
 
 //       Raspberry Pi's GPIO      PC
 #define RD_DAT 4  // [11: 4] <--  PB7-PB0 Read DAT
@@ -224,6 +231,452 @@ void send_sector_data(int num_dat, int num_sec, uint8_t *buf) {
     }
 }
 
+// ----------------------------------------------------------------------
+// Burst transfer (extension, not in the original PC-80S31)
+// ----------------------------------------------------------------------
+// Used only by cooperating loaders on the PC side. Both directions use
+// transition signalling: every DAV edge, rising or falling, carries one byte.
+// Each sector is 256 data bytes followed by the 16-bit sum of the data
+// (low, high). That makes 258 edges per sector, so DAV is low again at the
+// end of every sector.
+// The receiving side requests each sector by toggling its RFD once: RFD goes
+// high for the first sector, low for the second, and so on. Neither side has
+// to catch a short pulse, however slowly it polls.
+//
+// Burst Write (PC -> RPi), per sector:
+//   RPi toggles RFD when it is ready for the sector. The PC waits for the
+//   change, writes DAT and then toggles DAV for each byte, and RPi acknowledges
+//   by driving DAC to the same level. RPi de-asserts RFD after the last sector.
+//   The PC checks nothing: a checksum error is reported by the result status
+//   (0x06). If DAV stops changing for BURST_TIMEOUT ms, RPi drops RFD and DAC
+//   and fails the transfer, so that the PC can give up and resend the command.
+// Burst Send (RPi -> PC), per sector:
+//   The PC toggles RFD when it is ready for the sector. RPi waits for the
+//   change, writes DAT and then toggles DAV for each byte, and the PC
+//   acknowledges by driving DAC to the same level. The PC checks the sum
+//   itself, and de-asserts RFD after the last sector.
+#define BURST_SUM_SIZE 2
+#define BURST_TIMEOUT 100 // ms
+#define BURST_POLLS 1024  // Polls between timeout checks
+
+// RFD level that requests the n-th sector of a transfer
+#define BURST_RFD(n) (~(n) & 1)
+
+static inline uint64_t burst_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+// Receive sector data in burst mode, as the sectors from the first-th on of
+// the transfer. Returns the number of bad sectors, or -1 on timeout. The caller
+// de-asserts RFD when the transfer is over.
+int receive_sector_data_burst(int first, int num_sec, uint8_t *buf) {
+    int err = 0;
+    uint32_t level = 0;
+
+    for (int s = 0; s < num_sec; s++) {
+        uint8_t *p = &buf[SECTOR_SIZE * s];
+        uint8_t sum_dat[BURST_SUM_SIZE];
+        uint16_t sum = 0;
+
+        sig_stat("Burst: Toggle RFD");
+        gpio_write(WR_RFD, BURST_RFD(first + s), 1);
+        for (int i = 0; i < SECTOR_SIZE + BURST_SUM_SIZE; i++) {
+            uint32_t d;
+            uint64_t start = 0;
+            for (int n = 0; BIT(d = gpio_read(0, 32), RD_DAV) == level; n++) {
+                if (n % BURST_POLLS) {
+                    continue;
+                }
+                if (!start) {
+                    start = burst_ms();
+                } else if (burst_ms() - start > BURST_TIMEOUT) {
+                    DP("Burst: Timeout at sector %d byte %d\n", first + s, i);
+                    DE_ASSERT_BIT(WR_DAC)
+                    DE_ASSERT_BIT(WR_RFD)
+                    return -1;
+                }
+            }
+            level ^= 1;
+            gpio_write(WR_DAC, level, 1);
+            // DAT is stable before DAV changes, so it is taken from the same sample.
+            uint8_t dat = BITS(d, RD_DAT, 8);
+            if (i < SECTOR_SIZE) {
+                p[i] = dat;
+                sum += dat;
+            } else {
+                sum_dat[i - SECTOR_SIZE] = dat;
+            }
+        }
+
+        if (GET_2BYTE(sum_dat) != sum) {
+            DP("Burst: Checksum error at sector %d (%04x != %04x)\n", first + s, GET_2BYTE(sum_dat), sum);
+            err++;
+        }
+    }
+    return err;
+}
+
+// Send sector data in burst mode, as the sectors from the first-th on of the
+// transfer
+void send_sector_data_burst(int first, int num_sec, uint8_t *buf) {
+    uint32_t level = 0;
+
+    for (int s = 0; s < num_sec; s++) {
+        uint8_t *p = &buf[SECTOR_SIZE * s];
+        uint8_t sum_dat[BURST_SUM_SIZE];
+        uint16_t sum = 0;
+
+        for (int i = 0; i < SECTOR_SIZE; i++) {
+            sum += p[i];
+        }
+        SET_2BYTE(sum_dat, sum);
+
+        sig_stat("Burst: Wait for RFD toggle");
+        if (BURST_RFD(first + s)) {
+            wait_high(RD_RFD);
+        } else {
+            wait_low(RD_RFD);
+        }
+        for (int i = 0; i < SECTOR_SIZE + BURST_SUM_SIZE; i++) {
+            write_dat_gpio(i < SECTOR_SIZE ? p[i] : sum_dat[i - SECTOR_SIZE]);
+            level ^= 1;
+            gpio_write(WR_DAV, level, 1);
+            if (level) {
+                wait_high(RD_DAC);
+            } else {
+                wait_low(RD_DAC);
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------
+// Transfer throughput (to compare burst commands with standard ones)
+// ----------------------------------------------------------------------
+// Totals per command are included in the statistics dump (see dump_stat()),
+// so that the commands can be compared over the same session.
+static struct timespec xfer_start;
+static uint8_t xfer_cmd;
+uint64_t xfer_bytes[256];
+uint64_t xfer_us[256];
+
+static inline void xfer_begin(uint8_t cmd) {
+    xfer_cmd = cmd;
+    clock_gettime(CLOCK_MONOTONIC, &xfer_start);
+}
+
+void xfer_end(char *mes, int num_sec) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    long us = (t.tv_sec - xfer_start.tv_sec) * 1000000L + (t.tv_nsec - xfer_start.tv_nsec) / 1000;
+    long bytes = (long)SECTOR_SIZE * num_sec;
+    xfer_bytes[xfer_cmd] += bytes;
+    xfer_us[xfer_cmd] += us;
+    DP("%s: %ld bytes in %ld us (%ld bytes/s)\n", mes, bytes, us, us ? bytes * 1000000L / us : 0);
+}
+
+// ======================================================================
+// Disk I/O pipeline
+// ======================================================================
+// The disk I/O of a transfer runs on a worker thread. The image is read and
+// written a track at a time: the track is loaded by PIPE_BEGIN and written
+// back by PIPE_END, and PIPE_SECTOR only copies a sector in memory.
+// On writes, the track is loaded while the first sectors are arriving, and
+// only the write back is left after the last byte. On reads, 0x02 returns
+// at once, and the track is loaded while the PC goes on to 0x06 and 0x03;
+// errors are reported by the next 0x06. Jobs are processed in order, and once
+// a job fails the rest of the transfer is skipped.
+#define PIPE_DEPTH 64
+#define PIPE_BEGIN 0  // md_begin() and check that all the sectors exist
+#define PIPE_SECTOR 1 // md_sector()
+#define PIPE_END 2    // md_end()
+
+#define XFER_BURST 0 // Pass as num_dat for burst transfer
+
+typedef struct {
+    uint8_t op;
+    uint8_t rw;
+    uint8_t drive;
+    uint8_t tr;
+    uint8_t sec;
+    uint8_t num_sec;
+    uint8_t *buf;
+} pipe_job_t;
+
+static pipe_job_t pipe_job[PIPE_DEPTH];
+static uint32_t pipe_posted;
+static uint32_t pipe_done;
+static int pipe_err;
+static pthread_mutex_t pipe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipe_cond = PTHREAD_COND_INITIALIZER;
+
+void *pipe_worker(void *arg) {
+    uint32_t n = 0;
+    int locked = 0; // Between md_begin() and md_end()
+    while (1) {
+        pthread_mutex_lock(&pipe_lock);
+        while (pipe_posted == n) {
+            pthread_cond_wait(&pipe_cond, &pipe_lock);
+        }
+        pthread_mutex_unlock(&pipe_lock);
+
+        pipe_job_t *j = &pipe_job[n % PIPE_DEPTH];
+        int err = __atomic_load_n(&pipe_err, __ATOMIC_RELAXED);
+        int ret = 0;
+        switch (j->op) {
+        case PIPE_BEGIN:
+            if (!err) {
+                ret = md_begin(j->drive, j->tr, j->sec, j->num_sec, j->rw);
+                locked = ret == 0 && j->num_sec;
+                for (int i = 0; ret == 0 && i < j->num_sec; i++) {
+                    ret = md_find_sector(j->drive, j->tr, j->sec + i) < 0;
+                }
+            }
+            break;
+        case PIPE_SECTOR:
+            if (!err) {
+                ret = md_sector(j->drive, j->tr, j->sec, j->buf, j->rw);
+            }
+            break;
+        case PIPE_END:
+            // This always comes, so that md_begin() is always paired.
+            if (locked) {
+                if (err) {
+                    md_abort(j->drive);
+                } else {
+                    ret = md_end(j->drive, j->tr, j->rw);
+                }
+                locked = 0;
+            }
+            break;
+        }
+        if (ret) {
+            __atomic_store_n(&pipe_err, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&pipe_done, ++n, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void init_pipe() {
+    pthread_t th;
+    int ret = pthread_create(&th, NULL, pipe_worker, NULL);
+    assert(ret == 0);
+    pthread_detach(th);
+}
+
+// Wait until the job is done. This spins, as the handshake does.
+static inline void pipe_wait(uint32_t id) {
+    while ((int32_t)(__atomic_load_n(&pipe_done, __ATOMIC_ACQUIRE) - id) < 0) {
+    }
+}
+
+static uint32_t read_begin; // PIPE_BEGIN of the last read
+static int read_pending;    // Its result has not been reported yet
+
+// Wait until all the jobs are done. The result of a pending read is dropped,
+// as the next command replaces the result status anyway.
+static inline void pipe_sync() {
+    pipe_wait(pipe_posted);
+    read_pending = 0;
+}
+
+// Post a job, and return its id to wait for
+uint32_t pipe_post(uint8_t op, uint8_t rw, uint8_t drive, uint8_t tr, uint8_t sec, uint8_t num_sec, uint8_t *buf) {
+    pipe_wait(pipe_posted - PIPE_DEPTH + 1);
+
+    pipe_job_t *j = &pipe_job[pipe_posted % PIPE_DEPTH];
+    j->op = op;
+    j->rw = rw;
+    j->drive = drive;
+    j->tr = tr;
+    j->sec = sec;
+    j->num_sec = num_sec;
+    j->buf = buf;
+
+    pthread_mutex_lock(&pipe_lock);
+    pipe_posted++;
+    pthread_cond_signal(&pipe_cond);
+    pthread_mutex_unlock(&pipe_lock);
+    return pipe_posted;
+}
+
+// Receive sectors and write them to the disk, using two sector slots in turn
+int receive_write_sectors(int num_dat, uint8_t drive, uint8_t tr, uint8_t sec, uint8_t num_sec) {
+    static uint8_t slot[2][SECTOR_SIZE];
+    uint32_t slot_job[2];
+    int err = 0;
+
+    pipe_sync();
+    pipe_err = 0;
+    // Both slots are free, so the first two sectors arrive while the track is loaded.
+    slot_job[0] = slot_job[1] = pipe_posted;
+    pipe_post(PIPE_BEGIN, MD_WRITE, drive, tr, sec, num_sec, NULL);
+    for (int i = 0; i < num_sec; i++) {
+        uint8_t *p = slot[i % 2];
+        pipe_wait(slot_job[i % 2]);
+        if (num_dat == XFER_BURST) {
+            int bad = receive_sector_data_burst(i, 1, p);
+            if (bad) {
+                // Make the rest of the transfer skipped, and the track left as it is
+                __atomic_store_n(&pipe_err, 1, __ATOMIC_RELAXED);
+                err = 1;
+                if (bad < 0) {
+                    break; // The PC has gone away.
+                }
+                continue;
+            }
+        } else {
+            receive_sector_data(num_dat, 1, p);
+        }
+        slot_job[i % 2] = pipe_post(PIPE_SECTOR, MD_WRITE, drive, tr, sec + i, 1, p);
+    }
+    if (num_dat == XFER_BURST) {
+        DE_ASSERT_BIT(WR_RFD)
+    }
+    if (num_sec) {
+        pipe_post(PIPE_END, MD_WRITE, drive, tr, sec, num_sec, NULL);
+    }
+    pipe_sync();
+    return (err || __atomic_load_n(&pipe_err, __ATOMIC_RELAXED)) ? -1 : 0;
+}
+
+// Start reading sectors into the buffer. This returns at once, and the track
+// is loaded in the background. Use read_result() for the result.
+static uint32_t read_job[NUM_SECTOR];
+
+int start_read_sectors(uint8_t drive, uint8_t tr, uint8_t sec, uint8_t num_sec, uint8_t *buf) {
+    if (num_sec > NUM_SECTOR) {
+        DP("Too many sectors: %d\n", num_sec);
+        return -1;
+    }
+
+    pipe_sync();
+    pipe_err = 0;
+    read_begin = pipe_post(PIPE_BEGIN, MD_READ, drive, tr, sec, num_sec, NULL);
+    read_pending = 1;
+    for (int i = 0; i < num_sec; i++) {
+        read_job[i] = pipe_post(PIPE_SECTOR, MD_READ, drive, tr, sec + i, 1, &buf[SECTOR_SIZE * i]);
+    }
+    if (num_sec) {
+        pipe_post(PIPE_END, MD_READ, drive, tr, sec, num_sec, NULL);
+    }
+    return 0;
+}
+
+// Wait until the track of the pending read is loaded and the sectors are
+// found. Returns -1 if the read has failed, and 0 otherwise.
+int read_result() {
+    if (!read_pending) {
+        return 0;
+    }
+    read_pending = 0;
+    pipe_wait(read_begin);
+    return __atomic_load_n(&pipe_err, __ATOMIC_RELAXED) ? -1 : 0;
+}
+
+// Send the sectors in the buffer, each as soon as it has been read
+void send_read_sectors(int num_dat, int num_sec, uint8_t *buf) {
+    for (int i = 0; i < num_sec; i++) {
+        if (i < NUM_SECTOR) {
+            pipe_wait(read_job[i]);
+        }
+        if (num_dat == XFER_BURST) {
+            send_sector_data_burst(i, 1, &buf[SECTOR_SIZE * i]);
+        } else {
+            send_sector_data(num_dat, 1, &buf[SECTOR_SIZE * i]);
+        }
+    }
+    if (num_dat == XFER_BURST) {
+        sig_stat("Burst: Wait RFD low");
+        wait_low(RD_RFD);
+    }
+}
+
+// ======================================================================
+// Statistics
+// ======================================================================
+// Send SIGUSR1 to dump the access statistics into STAT_FILE (JSON) and
+// print heatmaps of the drives.
+#define STAT_FILE "pc80s31_stat.json"
+uint32_t cmd_count[256];
+
+void dump_stat() {
+    FILE *fp = fopen(STAT_FILE ".tmp", "w");
+    if (fp == NULL) {
+        perror("Cannot create " STAT_FILE);
+        return;
+    }
+    fprintf(fp, "{\"commands\":{");
+    for (int i = 0, n = 0; i < 256; i++) {
+        if (cmd_count[i]) {
+            fprintf(fp, "%s\"0x%02x\":%u", n++ ? "," : "", i, cmd_count[i]);
+        }
+    }
+    fprintf(fp, "},\"transfers\":{");
+    for (int i = 0, n = 0; i < 256; i++) {
+        if (xfer_bytes[i]) {
+            fprintf(fp, "%s\"0x%02x\":{\"bytes\":%llu,\"us\":%llu,\"bytes_per_s\":%llu}", n++ ? "," : "", i,
+                    (unsigned long long)xfer_bytes[i], (unsigned long long)xfer_us[i],
+                    (unsigned long long)(xfer_us[i] ? xfer_bytes[i] * 1000000 / xfer_us[i] : 0));
+        }
+    }
+    fprintf(fp, "},\"drives\":[");
+    for (int i = 0; i < MAX_DRIVE; i++) {
+        fprintf(fp, "%s", i ? "," : "");
+        md_stat_json(fp, i);
+    }
+    fprintf(fp, "],\"order\":");
+    md_stat_json_sample(fp);
+    fprintf(fp, ",\"scrub\":");
+    md_scrub_json(fp);
+    fprintf(fp, "}\n");
+    fclose(fp);
+    rename(STAT_FILE ".tmp", STAT_FILE);
+
+    for (int i = 0; i < MAX_DRIVE; i++) {
+        md_stat_heatmap(stdout, i);
+    }
+    md_scrub_report(stdout);
+    printf("Statistics dumped into %s\n", STAT_FILE);
+}
+
+// SIGINT shuts the emulator down from here rather than from a signal handler,
+// which could interrupt a thread holding a lock that finalize() needs. The
+// other threads keep running; md_close() waits for the access in progress.
+void *stat_thread(void *arg) {
+    sigset_t *set = (sigset_t *)arg;
+    int sig;
+    while (sigwait(set, &sig) == 0) {
+        if (sig == SIGINT) {
+            puts("Caught signal.");
+            finalize();
+            exit(0);
+        }
+        dump_stat();
+    }
+    return NULL;
+}
+
+// This must be called before any other thread is created, so that SIGUSR1 and
+// SIGINT are blocked in all threads and only caught by sigwait().
+void init_stat() {
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_t th;
+    if (pthread_create(&th, NULL, stat_thread, &set)) {
+        perror("Cannot create statistics thread");
+        return;
+    }
+    pthread_detach(th);
+}
+
 // ======================================================================
 // Main
 // ======================================================================
@@ -244,21 +697,78 @@ uint8_t buf[SECTOR_SIZE * NUM_SECTOR];
 int main(int argc, char *argv[]) {
     setvbuf(stdout, (char *)NULL, _IONBF, 0);
 
+    init_stat();
+    init_pipe();
     MGPIO_Init();
     init_gpio();
     MD_Init();
 
     int ret;
-    if (argc > 1) {
-        for (int i = 0; i < MAX(1, argc - 1); i++) {
-            printf("Mount [%s] on Drive %d\n", argv[1 + i], i + 1);
-            ret = md_open(i, argv[1 + i]);
+    char *sock_path = NULL;
+    mode_t sock_mode = MSOCK_MODE;
+    mcat_t cat;
+    ZEROFILL(cat);
+    while ((ret = getopt(argc, argv, "ns:m:c:v")) != -1) {
+        switch (ret) {
+        case 'n':
+            puts("N88-DISK BASIC file-aware prefetch enabled");
+            MN88_Init();
+            break;
+        case 's':
+            sock_path = optarg;
+            break;
+        case 'm':
+            sock_mode = strtoul(optarg, NULL, 8) & 0777;
+            break;
+        case 'v':
+            puts("On-access checksum verification enabled");
+            md_verify = 1;
+            break;
+        case 'c':
+            if (mcat_open(&cat, optarg)) {
+                fprintf(stderr, "Cannot open catalog [%s]\n", optarg);
+                exit(1);
+            }
+            printf("Catalog [%s] (%d images)\n", optarg, cat.hdr->num);
+            break;
+        default:
+            optind = argc; // Show usage
+            break;
+        }
+    }
+    if (optind < argc) {
+        for (int i = 0; i < argc - optind; i++) {
+            char *fname = argv[optind + i];
+            // Not a file: Look up the catalog by disk name or hash.
+            const mcat_entry_t *e = access(fname, F_OK) ? mcat_find(&cat, fname) : NULL;
+            disk_hdr_t hdr;
+            if (e != NULL) {
+                fname = (char *)mcat_path(&cat, e);
+            }
+            printf("Mount [%s] on Drive %d\n", fname, i + 1);
+            if (e != NULL && mcat_header(&cat, e, &hdr) == 0) {
+                ret = md_open_hdr(i, fname, &hdr);
+            } else {
+                ret = md_open(i, fname);
+            }
             assert(ret == 0);
         }
+        mcat_close(&cat);
     } else {
-        printf("Usage: %0 disk1.d88 [disk2.d88]\n");
+        printf("Usage: %s [-n] [-v] [-s socket [-m mode]] [-c catalog] disk1.d88 [disk2.d88]\n", argv[0]);
+        printf("  -n: Prefetch files on N88-DISK BASIC disks\n");
+        printf("  -v: Verify the checksums of tracks read from the images\n");
+        printf("  -s: Serve sector access to other processes on the UNIX socket\n");
+        printf("  -m: Mode of the socket in octal (default %04o)\n", MSOCK_MODE);
+        printf("  -c: Mount disks by name or hash in the catalog built by mkcatalog\n");
         exit(0);
     }
+    if (sock_path != NULL) {
+        ret = MSOCK_Init(sock_path, sock_mode);
+        assert(ret == 0);
+    }
+    // Keep the busy-polling loop below off the scrubber's CPU.
+    md_pin_protocol();
 
     sig_stat("Wait for RST");
     do {
@@ -276,6 +786,8 @@ int main(int argc, char *argv[]) {
     while (1) {
         uint8_t cmd = read_cmd();
         DP("CMD: (%02x) ", cmd);
+        cmd_count[cmd]++;
+        md_scrub_hold(1);
         switch (cmd) {
         case 0x00:
             DP("Initialize\n");
@@ -287,8 +799,10 @@ int main(int argc, char *argv[]) {
             tr = receive_dat(1);
             sec = receive_dat(1) - 1; // Translate sector number.
             DP("Write Disk: num_sec=%d drive=%d tr=%d sec=%d\n", num_sec, drive, tr, sec + 1);
-            receive_sector_data(1, num_sec, buf);
-            if (md_write(drive, tr, sec, num_sec, buf) == 0) {
+            xfer_begin(cmd);
+            ret = receive_write_sectors(1, drive, tr, sec, num_sec);
+            xfer_end("Write Disk", num_sec);
+            if (ret == 0) {
                 result_stat.bit.is_error = 0;
             } else {
                 result_stat.bit.is_error = 1;
@@ -300,7 +814,7 @@ int main(int argc, char *argv[]) {
             tr = receive_dat(1);
             sec = receive_dat(1) - 1; // Translate sector number.
             DP("Read Disk: num_sec=%d drive=%d tr=%d sec=%d\n", num_sec, drive, tr, sec + 1);
-            if (md_read(drive, tr, sec, num_sec, buf) == 0) {
+            if (start_read_sectors(drive, tr, sec, num_sec, buf) == 0) {
                 result_stat.bit.is_unread_buf = 1;
                 result_stat.bit.is_error = 0;
             } else {
@@ -310,7 +824,9 @@ int main(int argc, char *argv[]) {
             break;
         case 0x03:
             DP("Send Data: num_sec=%d\n", num_sec);
-            send_sector_data(1, num_sec, buf);
+            xfer_begin(cmd);
+            send_read_sectors(1, num_sec, buf);
+            xfer_end("Send Data", num_sec);
             result_stat.bit.is_unread_buf = 0;
             break;
         case 0x04: {
@@ -322,6 +838,7 @@ int main(int argc, char *argv[]) {
             int dst_tr = receive_dat(1);
             int dst_sec = receive_dat(1) - 1; // Translate sector number.
             DP("Copy: num_sec=%d (drive=%d,tr=%d,sec=%d)->(drive=%d,trt=%d,sec=%d)\n", num_sec, src_drive, src_tr, src_sec + 1, dst_drive, dst_tr, dst_sec + 1);
+            pipe_sync();
             for (int i = 0; i < num_sec; i++) {
                 if (md_read(src_drive, src_tr, src_sec, num_sec, buf) != 0) {
                     result_stat.bit.is_error = 1;
@@ -338,6 +855,7 @@ int main(int argc, char *argv[]) {
         case 0x05:
             drive = receive_dat(1);
             DP("Format: drive=%d\n", drive);
+            pipe_sync();
             if (md_format(drive)) {
                 result_stat.bit.is_error = 0;
             } else {
@@ -345,6 +863,10 @@ int main(int argc, char *argv[]) {
             }
             break;
         case 0x06:
+            if (read_result()) {
+                result_stat.bit.is_unread_buf = 0;
+                result_stat.bit.is_error = 1;
+            }
             DP("Result Status: complete=%d unread=%d Err=%d\n", result_stat.bit.is_io_complete, result_stat.bit.is_unread_buf, result_stat.bit.is_error);
             send_dat(1, (uint16_t)result_stat.dat);
             break;
@@ -376,8 +898,10 @@ int main(int argc, char *argv[]) {
             tr = receive_dat(1);
             sec = receive_dat(1) - 1; // Translate sector number.;
             DP("Fast Write Disk: num_sec=%d drive=%d tr=%d sec=%d\n", num_sec, drive, tr, sec + 1);
-            receive_sector_data(2, num_sec, buf);
-            if (md_write(drive, tr, sec, num_sec, buf) == 0) {
+            xfer_begin(cmd);
+            ret = receive_write_sectors(2, drive, tr, sec, num_sec);
+            xfer_end("Fast Write Disk", num_sec);
+            if (ret == 0) {
                 result_stat.bit.is_error = 0;
             } else {
                 result_stat.bit.is_error = 1;
@@ -386,7 +910,9 @@ int main(int argc, char *argv[]) {
             break;
         case 0x12:
             DP("Fast Send Data: num_sec=%d\n", num_sec);
-            send_sector_data(2, num_sec, buf);
+            xfer_begin(cmd);
+            send_read_sectors(2, num_sec, buf);
+            xfer_end("Fast Send Data", num_sec);
             result_stat.bit.is_unread_buf = 0;
             break;
         case 0x14:
@@ -408,10 +934,34 @@ int main(int argc, char *argv[]) {
             uint8_t m = receive_dat(1);
             DP("Mode Change: %d,%d,%d,%d\n", BIT(m, 3), BIT(m, 2), BIT(m, 1), BIT(m, 0));
         } break;
+        case 0x18:
+            num_sec = receive_dat(1);
+            drive = receive_dat(1);
+            tr = receive_dat(1);
+            sec = receive_dat(1) - 1; // Translate sector number.
+            DP("Burst Write Disk: num_sec=%d drive=%d tr=%d sec=%d\n", num_sec, drive, tr, sec + 1);
+            xfer_begin(cmd);
+            ret = receive_write_sectors(XFER_BURST, drive, tr, sec, num_sec);
+            xfer_end("Burst Write Disk", num_sec);
+            if (ret == 0) {
+                result_stat.bit.is_error = 0;
+            } else {
+                result_stat.bit.is_error = 1;
+            }
+            result_stat.bit.is_io_complete = 1;
+            break;
+        case 0x19:
+            DP("Burst Send Data: num_sec=%d\n", num_sec);
+            xfer_begin(cmd);
+            send_read_sectors(XFER_BURST, num_sec, buf);
+            xfer_end("Burst Send Data", num_sec);
+            result_stat.bit.is_unread_buf = 0;
+            break;
         default:
             DP("[Undefined]\n");
             break;
         }
+        md_scrub_hold(0);
     }
     finalize();
 }